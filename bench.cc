@@ -0,0 +1,1486 @@
+#include <iostream>
+#include <vector>
+#include <list>
+#include <chrono>
+#include <cstdlib>
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "matrix_kernels.h"
+#include "spatial.h"
+#include "culling.h"
+#include "bvh.h"
+#include "clusters.h"
+#include "render_queue.h"
+#include "command_list.h"
+#include "uniform_tracking.h"
+#include <algorithm>
+#include <map>
+#include <array>
+#include <tuple>
+
+
+using namespace std;
+using namespace glm;
+
+/*
+ * Stand ins for the GL entry points gl_state.h calls. They count the calls and keep the resulting state, so the
+ * cache can be checked against unfiltered submission without a context
+ */
+typedef unsigned int GLenum;
+typedef unsigned int GLuint;
+typedef int GLint;
+typedef int GLsizei;
+typedef unsigned char GLboolean;
+typedef ptrdiff_t GLintptr;
+typedef ptrdiff_t GLsizeiptr;
+
+#define GL_FALSE 0
+#define GL_TRUE 1
+#define GL_LESS 0x0201
+#define GL_FRONT 0x0404
+#define GL_BACK 0x0405
+#define GL_CULL_FACE 0x0B44
+#define GL_DEPTH_TEST 0x0B71
+#define GL_BLEND 0x0BE2
+#define GL_TEXTURE_2D 0x0DE1
+#define GL_TEXTURE0 0x84C0
+#define GL_TEXTURE_CUBE_MAP 0x8513
+#define GL_TEXTURE_2D_ARRAY 0x8C1A
+#define GL_INT 0x1404
+#define GL_FLOAT 0x1406
+#define GL_FLOAT_VEC2 0x8B50
+#define GL_FLOAT_VEC3 0x8B51
+#define GL_FLOAT_VEC4 0x8B52
+#define GL_BOOL 0x8B56
+#define GL_FLOAT_MAT2 0x8B5A
+#define GL_FLOAT_MAT3 0x8B5B
+#define GL_FLOAT_MAT4 0x8B5C
+#define GL_UNIFORM_BUFFER 0x8A11
+
+namespace MockGL
+{
+    size_t calls = 0;
+
+    GLuint program = 0,vertexArray = 0,activeUnit = 0;
+    map<GLenum,bool> enabled;
+    map<pair<GLuint,GLenum>,GLuint> textures;           // unit, target -> texture
+    map<pair<GLuint,GLint>,GLint> uniforms;             // program, location -> value
+    map<pair<GLuint,GLint>,vec4> values;                // program, location -> float uniform value
+    map<GLuint,pair<GLintptr,GLsizeiptr>> uniformRanges;    // binding -> offset, size
+    size_t uniformUploads = 0;
+    bool keepValues = true;                             // Off for timing, uploads then only add to the checksum
+    double checksum = 0;
+
+    inline void uniform(GLint location,const float* value,size_t count)
+    {
+        calls++;
+        uniformUploads++;
+        for (size_t i = 0; i < count; i++) checksum += value[i] * (location + 1);
+        if (keepValues) values[{program,location}] = count == 4 ? vec4(value[0],value[1],value[2],value[3]) : vec4(value[0]);
+    }
+    GLboolean depthMask = GL_TRUE,colorMask = GL_TRUE;
+    GLenum depthFunc = GL_LESS,cullFace = GL_BACK;
+    GLenum blendSource,blendDestination;
+    GLint viewport[4];
+
+    // State every draw saw, compared between submission paths
+    vector<vector<size_t>> draws;
+
+    inline void draw()
+    {
+        vector<size_t> state = {program,vertexArray,depthMask,cullFace,depthFunc,enabled[GL_CULL_FACE],enabled[GL_DEPTH_TEST]};
+        for (const auto& texture : textures) state.insert(state.end(),{texture.first.first,texture.first.second,texture.second});
+        for (const auto& uniform : uniforms)
+            if (uniform.first.first == program) state.insert(state.end(),{size_t(uniform.first.second),size_t(uniform.second)});
+        draws.push_back(state);
+    }
+}
+
+void glUseProgram(GLuint program) { MockGL::calls++; MockGL::program = program; }
+void glBindVertexArray(GLuint vertexArray) { MockGL::calls++; MockGL::vertexArray = vertexArray; }
+void glActiveTexture(GLenum unit) { MockGL::calls++; MockGL::activeUnit = unit - GL_TEXTURE0; }
+void glBindTexture(GLenum target,GLuint texture) { MockGL::calls++; MockGL::textures[{MockGL::activeUnit,target}] = texture; }
+void glEnable(GLenum capability) { MockGL::calls++; MockGL::enabled[capability] = true; }
+void glDisable(GLenum capability) { MockGL::calls++; MockGL::enabled[capability] = false; }
+void glDepthMask(GLboolean mask) { MockGL::calls++; MockGL::depthMask = mask; }
+void glColorMask(GLboolean red,GLboolean green,GLboolean blue,GLboolean alpha) { MockGL::calls++; MockGL::colorMask = red && green && blue && alpha; }
+void glDepthFunc(GLenum function) { MockGL::calls++; MockGL::depthFunc = function; }
+void glCullFace(GLenum mode) { MockGL::calls++; MockGL::cullFace = mode; }
+void glBlendFunc(GLenum source,GLenum destination) { MockGL::calls++; MockGL::blendSource = source; MockGL::blendDestination = destination; }
+void glViewport(GLint x,GLint y,GLsizei width,GLsizei height) { MockGL::calls++; MockGL::viewport[0] = x; MockGL::viewport[1] = y; MockGL::viewport[2] = width; MockGL::viewport[3] = height; }
+void glUniform1i(GLint location,GLint value)
+{
+    MockGL::calls++;
+    MockGL::checksum += double(value) * (location + 1);
+    if (MockGL::keepValues) MockGL::uniforms[{MockGL::program,location}] = value;
+}
+void glBindBufferRange(GLenum,GLuint index,GLuint,GLintptr offset,GLsizeiptr size)
+{
+    MockGL::calls++;
+    MockGL::uniformRanges[index] = {offset,size};
+}
+void glUniform1f(GLint location,float value) { MockGL::uniform(location,&value,1); }
+void glUniform2fv(GLint location,GLsizei,const float* value) { MockGL::uniform(location,value,2); }
+void glUniform3fv(GLint location,GLsizei,const float* value) { MockGL::uniform(location,value,3); }
+void glUniform4fv(GLint location,GLsizei,const float* value) { MockGL::uniform(location,value,4); }
+void glUniformMatrix2fv(GLint location,GLsizei,GLboolean,const float* value) { MockGL::uniform(location,value,4); }
+void glUniformMatrix3fv(GLint location,GLsizei,GLboolean,const float* value) { MockGL::uniform(location,value,9); }
+void glUniformMatrix4fv(GLint location,GLsizei,GLboolean,const float* value) { MockGL::uniform(location,value,16); }
+
+#include "gl_state.h"
+#include "uniforms.h"
+
+/*
+ * CPU side benchmarks, they don't need a GL context
+ */
+
+namespace Bench
+{
+    using Clock = chrono::high_resolution_clock;
+
+    size_t allocations = 0;
+    size_t allocatedBytes = 0;
+
+    inline double elapsedNs(Clock::time_point start)
+    {
+        return chrono::duration<double,nano>(Clock::now() - start).count();
+    }
+
+    inline mat4 randomTransform()
+    {
+        vec3 offset(rand() % 10 - 5,rand() % 10 - 5,rand() % 10 - 5);
+        return glm::rotate(glm::translate(mat4(1.0),offset),(rand() % 628) / 100.0f,vec3(0.2,1,0));
+    }
+
+    // Random recursive tree, node i hangs from any of the nodes created before it
+    inline vector<size_t> randomParents(size_t count)
+    {
+        vector<size_t> parents(count);
+        for (size_t i = 0; i < count; i++)
+            parents[i] = i == 0 || rand() % 64 == 0 ? SpatialHierarchy::noParent : size_t(rand()) % i;
+        return parents;
+    }
+
+    // Long chains that branch now and then
+    inline vector<size_t> deepParents(size_t count)
+    {
+        vector<size_t> parents(count);
+        for (size_t i = 0; i < count; i++)
+            parents[i] = i == 0 ? SpatialHierarchy::noParent : rand() % 16 == 0 ? size_t(rand()) % i : i - 1;
+        return parents;
+    }
+
+    // Few levels, every node hangs from one of the first nodes
+    inline vector<size_t> wideParents(size_t count)
+    {
+        vector<size_t> parents(count);
+        for (size_t i = 0; i < count; i++)
+            parents[i] = i < 16 ? SpatialHierarchy::noParent : size_t(rand()) % std::min<size_t>(i,4096);
+        return parents;
+    }
+}
+
+/*
+ * Counts heap allocations so hot paths can be checked to be allocation free. Every form of new and delete goes through
+ * the same pair, kept out of line so the compiler doesn't see malloc and free meet new and delete
+ */
+namespace Bench
+{
+    __attribute__((noinline)) void* allocate(size_t size)
+    {
+        allocations++;
+        allocatedBytes += size;
+        if (void* ptr = malloc(size ? size : 1)) return ptr;
+        throw std::bad_alloc();
+    }
+
+    __attribute__((noinline)) void release(void* ptr) noexcept { free(ptr); }
+}
+
+void* operator new(size_t size) { return Bench::allocate(size); }
+void* operator new[](size_t size) { return Bench::allocate(size); }
+void operator delete(void* ptr) noexcept { Bench::release(ptr); }
+void operator delete[](void* ptr) noexcept { Bench::release(ptr); }
+void operator delete(void* ptr,size_t) noexcept { Bench::release(ptr); }
+void operator delete[](void* ptr,size_t) noexcept { Bench::release(ptr); }
+
+/*
+ * Pointer tree used by spatial.h before the flattened hierarchy, kept as the reference to compare against
+ */
+namespace Legacy
+{
+    struct SpatialNode
+    {
+        std::list<SpatialNode*> children;
+        SpatialNode* parent;
+
+        glm::mat4 combined;
+        glm::mat4 transform;
+
+        size_t cacheFrame = 0;
+
+        SpatialNode(SpatialNode* _parent,glm::mat4 _transform) : parent(_parent), transform(_transform) { }
+
+        inline glm::mat4 getCombined(size_t _cacheFrame)
+        {
+            if (cacheFrame) return combined;
+            combined = parent ? parent->getCombined(_cacheFrame) * transform : transform;
+            cacheFrame = _cacheFrame;
+            return combined;
+        }
+
+        inline void flush()
+        {
+            cacheFrame = 0;
+            for(auto &child : children) child->flush();
+        }
+    };
+}
+
+void benchHierarchyUpdate(size_t count,int frames)
+{
+    vector<size_t> parents = Bench::randomParents(count);
+    vector<mat4> transforms(count);
+    for (size_t i = 0; i < count; i++) transforms[i] = Bench::randomTransform();
+
+    vector<Legacy::SpatialNode*> nodes(count);
+    vector<Legacy::SpatialNode*> roots;
+    for (size_t i = 0; i < count; i++)
+    {
+        Legacy::SpatialNode* parent = parents[i] == SpatialHierarchy::noParent ? nullptr : nodes[parents[i]];
+        nodes[i] = new Legacy::SpatialNode(parent,transforms[i]);
+        if (parent) parent->children.push_back(nodes[i]);
+        else roots.push_back(nodes[i]);
+    }
+
+    SpatialHierarchy hierarchy;
+    hierarchy.reserve(count);
+    vector<SpatialID> ids(count);
+    for (size_t i = 0; i < count; i++)
+        ids[i] = hierarchy.create(transforms[i],parents[i] == SpatialHierarchy::noParent ? SpatialHierarchy::noParent : ids[parents[i]]);
+    hierarchy.update();
+
+    auto start = Bench::Clock::now();
+    for (int f = 1; f <= frames; f++)
+    {
+        for (auto root : roots) root->flush();
+        for (auto node : nodes) node->getCombined(f);
+    }
+    double legacyNs = Bench::elapsedNs(start) / (double(frames) * count);
+
+    start = Bench::Clock::now();
+    for (int f = 1; f <= frames; f++) hierarchy.updateAll();
+    double flatNs = Bench::elapsedNs(start) / (double(frames) * count);
+
+    float maxError = 0.0f;
+    for (size_t i = 0; i < count; i++)
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 4; r++)
+                maxError = glm::max(maxError,std::abs(nodes[i]->combined[c][r] - hierarchy.getCombined(ids[i])[c][r]));
+
+    cout << "hierarchy update " << count << " nodes: pointer tree " << legacyNs << " ns/node, flattened "
+         << flatNs << " ns/node (x" << legacyNs / flatNs << ") max error " << maxError << endl;
+
+    for (auto node : nodes) delete node;
+}
+
+void benchDirtyUpdate(size_t count,float changedFraction,int frames)
+{
+    vector<size_t> parents = Bench::randomParents(count);
+    SpatialHierarchy hierarchy;
+    hierarchy.reserve(count);
+    vector<SpatialID> ids(count);
+    for (size_t i = 0; i < count; i++)
+        ids[i] = hierarchy.create(Bench::randomTransform(),parents[i] == SpatialHierarchy::noParent ? SpatialHierarchy::noParent : ids[parents[i]]);
+    hierarchy.update();
+
+    size_t changes = count * changedFraction;
+    vector<mat4> edits(changes);
+    for (auto& edit : edits) edit = Bench::randomTransform();
+
+    double incrementalNs = 0.0,fullNs = 0.0;
+    size_t updated = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        for (size_t c = 0; c < changes; c++) hierarchy.setTransform(ids[rand() % count],edits[c]);
+
+        auto start = Bench::Clock::now();
+        hierarchy.update();
+        incrementalNs += Bench::elapsedNs(start);
+        updated += hierarchy.updatedNodes;
+
+        vector<mat4> incremental = hierarchy.combined;
+        start = Bench::Clock::now();
+        MatrixKernels::multiplyParented(&hierarchy.combined[0],&hierarchy.transforms[0],&hierarchy.parents[0],0,count);
+        fullNs += Bench::elapsedNs(start);
+
+        if (incremental != hierarchy.combined) cout << "incremental update differs from the full update" << endl;
+    }
+
+    cout << "dirty update " << count << " nodes, " << changes << " edits/frame: " << updated / frames << " nodes updated, "
+         << incrementalNs / frames / 1e3 << " us/frame vs full " << fullNs / frames / 1e3 << " us/frame" << endl;
+}
+
+void benchParallelUpdate(const char* name,const vector<size_t>& parents,int frames)
+{
+    size_t count = parents.size();
+    SpatialHierarchy hierarchy;
+    hierarchy.reserve(count);
+    vector<SpatialID> ids(count);
+    for (size_t i = 0; i < count; i++)
+        ids[i] = hierarchy.create(Bench::randomTransform(),parents[i] == SpatialHierarchy::noParent ? SpatialHierarchy::noParent : ids[parents[i]]);
+    hierarchy.updateAll();
+
+    vector<mat4> serial(count);
+    MatrixKernels::multiplyParented(&serial[0],&hierarchy.transforms[0],&hierarchy.parents[0],0,count);
+
+    #ifdef _OPENMP
+    int maxThreads = omp_get_max_threads();
+    #else
+    int maxThreads = 1;
+    #endif
+
+    double singleNs = 0.0;
+    for (int threads = 1; threads <= maxThreads; threads = threads == maxThreads ? threads + 1 : std::min(threads * 2,maxThreads))
+    {
+        #ifdef _OPENMP
+        omp_set_num_threads(threads);
+        #endif
+        hierarchy.updateAll();
+
+        auto start = Bench::Clock::now();
+        for (int f = 0; f < frames; f++) hierarchy.updateAll();
+        double ns = Bench::elapsedNs(start) / frames;
+        if (threads == 1) singleNs = ns;
+
+        cout << "parallel update " << name << " " << count << " nodes, " << threads << " threads: " << ns / 1e6 << " ms/frame (x"
+             << singleNs / ns << ", spine " << (threads == 1 ? 0 : hierarchy.spine.size()) << ")" << (hierarchy.combined == serial ? "" : " DIFFERS FROM SERIAL") << endl;
+    }
+
+    #ifdef _OPENMP
+    omp_set_num_threads(maxThreads);
+    #endif
+}
+
+/*
+ * Spawns and destroys nodes under random parents of a static scene, checks the churn doesn't allocate,
+ * doesn't leak slots or storage and leaves the same world matrices as a full recompute. Every frame also tries to
+ * hang a spawned node from itself and its parent from it, both have to be rejected or the cycle drops out of the order
+ */
+void benchSpatialChurn(size_t staticCount,size_t perSecond,int frames)
+{
+    SpatialHierarchy hierarchy;
+    size_t perFrame = perSecond / frames;
+    hierarchy.reserve(staticCount + perFrame * 4);
+
+    vector<SpatialID> statics(staticCount);
+    for (size_t i = 0; i < staticCount; i++) statics[i] = hierarchy.create(Bench::randomTransform(),i ? statics[rand() % i] : SpatialHierarchy::noParent);
+    hierarchy.update();
+
+    vector<SpatialID> spawned;
+    spawned.reserve(perFrame * 4);
+    mat4 local = Bench::randomTransform();
+
+    size_t staleHandles = 0,cycles = 0;
+    auto frame = [&]()
+    {
+        for (size_t i = 0; i < perFrame; i++)
+        {
+            SpatialID parent = !spawned.empty() && rand() % 4 == 0 ? spawned[rand() % spawned.size()] : statics[rand() % staticCount];
+            spawned.push_back(hierarchy.create(local,parent));
+        }
+
+        if (!spawned.empty())
+        {
+            SpatialID node = spawned[rand() % spawned.size()];
+            SpatialID parent = hierarchy.getParent(node);
+            hierarchy.setParent(node,node);
+            hierarchy.setParent(parent,node);
+            cycles += hierarchy.getParent(node) != parent || hierarchy.getParent(parent) == node;
+        }
+
+        for (size_t i = 0; i < perFrame && !spawned.empty(); i++)
+        {
+            size_t victim = rand() % spawned.size();
+            if (!hierarchy.destroy(spawned[victim])) staleHandles++;
+            spawned[victim] = spawned.back();
+            spawned.pop_back();
+        }
+        hierarchy.update();
+    };
+
+    // Warm up until every buffer reached its steady state capacity
+    for (int f = 0; f < frames; f++) frame();
+
+    size_t allocations = Bench::allocations;
+    auto start = Bench::Clock::now();
+    for (int f = 0; f < frames; f++) frame();
+    double ms = Bench::elapsedNs(start) / 1e6;
+    allocations = Bench::allocations - allocations;
+
+    for (SpatialID id : spawned) hierarchy.destroy(id);
+    hierarchy.updateAll();
+
+    size_t leakedSlots = hierarchy.generations.size() - hierarchy.freeSlots.size() - hierarchy.liveCount();
+    vector<mat4> full(hierarchy.size());
+    if (hierarchy.size()) MatrixKernels::multiplyParented(&full[0],&hierarchy.transforms[0],&hierarchy.parents[0],0,hierarchy.size());
+
+    cout << "spatial churn: " << perFrame * frames << " creates and destroys in " << ms << " ms, " << allocations << " allocations, "
+         << staleHandles << " stale handles rejected, " << cycles << " cycles made, live " << hierarchy.liveCount() << "/" << staticCount << ", leaked slots " << leakedSlots
+         << (full == hierarchy.combined ? "" : ", WORLD MATRICES DIFFER") << endl;
+}
+
+template <typename T>
+float maxDifference(const vector<T>& a,const vector<T>& b)
+{
+    float error = 0.0f;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        const float* x = (const float*)&a[i];
+        const float* y = (const float*)&b[i];
+        for (size_t k = 0; k < sizeof(T) / sizeof(float); k++)
+            error = glm::max(error,std::abs(x[k] - y[k]) / glm::max(1.0f,std::abs(x[k])));
+    }
+    return error;
+}
+
+template <typename F>
+double matricesPerSecond(size_t count,int repeats,F kernel)
+{
+    auto start = Bench::Clock::now();
+    for (int r = 0; r < repeats; r++) kernel();
+    return double(count) * repeats / (Bench::elapsedNs(start) * 1e-9);
+}
+
+void benchMatrixKernels(size_t count,int repeats)
+{
+    vector<mat4> a(count),b(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        a[i] = glm::scale(Bench::randomTransform(),vec3(0.5f + (rand() % 100) / 50.0f));
+        b[i] = Bench::randomTransform();
+    }
+
+    vector<mat4> reference(count),simd(count);
+    vector<mat3> referenceNormals(count),simdNormals(count);
+
+    double ref = matricesPerSecond(count,repeats,[&]{ MatrixKernels::Reference::multiply(&a[0],&b[0],&reference[0],count); });
+    double vec = matricesPerSecond(count,repeats,[&]{ MatrixKernels::multiply(&a[0],&b[0],&simd[0],count); });
+    cout << "multiply: scalar " << ref / 1e6 << " M/s, kernel " << vec / 1e6 << " M/s, max error " << maxDifference(reference,simd) << endl;
+
+    ref = matricesPerSecond(count,repeats,[&]{ MatrixKernels::Reference::inverse(&a[0],&reference[0],count); });
+    vec = matricesPerSecond(count,repeats,[&]{ MatrixKernels::inverse(&a[0],&simd[0],count); });
+    cout << "inverse: scalar " << ref / 1e6 << " M/s, kernel " << vec / 1e6 << " M/s, max error " << maxDifference(reference,simd) << endl;
+
+    ref = matricesPerSecond(count,repeats,[&]{ MatrixKernels::Reference::normalMatrices(&a[0],&referenceNormals[0],count); });
+    vec = matricesPerSecond(count,repeats,[&]{ MatrixKernels::normalMatrices(&a[0],&simdNormals[0],count); });
+    cout << "normal matrix: scalar " << ref / 1e6 << " M/s, kernel " << vec / 1e6 << " M/s, max error " << maxDifference(referenceNormals,simdNormals) << endl;
+}
+
+void benchFrustumCulling(size_t count,int repeats)
+{
+    Culling::Frustum frustum = Culling::extractFrustum(glm::perspective(glm::radians(90.0f),4.0f / 3.0f,0.1f,500.0f) *
+                                                       glm::translate(mat4(1.0),vec3(0,0,-5)));
+    Culling::SphereBatch spheres;
+    for (size_t i = 0; i < count; i++)
+        spheres.push_back(vec3(rand() % 2000 - 1000,rand() % 2000 - 1000,rand() % 2000 - 1000),(rand() % 100) / 10.0f);
+
+    vector<size_t> reference,simd;
+    double ref = matricesPerSecond(count,repeats,[&]{ Culling::Reference::cull(frustum,spheres,reference); });
+    double vec = matricesPerSecond(count,repeats,[&]{ Culling::cull(frustum,spheres,simd); });
+    cout << "frustum culling " << count << " spheres: scalar " << ref / 1e6 << " M/s, simd " << vec / 1e6 << " M/s, "
+         << simd.size() << " visible" << (reference == simd ? "" : ", RESULTS DIFFER") << endl;
+}
+
+void benchAABBTree(size_t count,size_t queries)
+{
+    vector<AABB> boxes(count);
+    DynamicAABBTree tree;
+    for (size_t i = 0; i < count; i++)
+    {
+        vec3 position(rand() % 2000 - 1000,rand() % 2000 - 1000,rand() % 2000 - 1000);
+        boxes[i] = AABB(position,position + vec3(1 + rand() % 10,1 + rand() % 10,1 + rand() % 10));
+        tree.insert(boxes[i],i);
+    }
+
+    // Refit with small motions, most boxes stay inside their fat bounds
+    auto start = Bench::Clock::now();
+    size_t reinserted = 0;
+    vector<size_t> proxies(count);
+    for (size_t i = 0; i < tree.nodes.size(); i++)
+        if (tree.nodes[i].height == 0) proxies[tree.nodes[i].userData] = i;
+    for (size_t i = 0; i < count; i++)
+    {
+        vec3 offset = vec3(rand() % 3 - 1,rand() % 3 - 1,rand() % 3 - 1) * float(rand() % 4) * 0.05f;
+        boxes[i] = AABB(boxes[i].min + offset,boxes[i].max + offset);
+        reinserted += tree.move(proxies[i],boxes[i]);
+    }
+    double refitNs = Bench::elapsedNs(start) / count;
+
+    Culling::Frustum frustum = Culling::extractFrustum(glm::perspective(glm::radians(60.0f),4.0f / 3.0f,0.1f,500.0f) *
+                                                       glm::translate(mat4(1.0),vec3(0,0,-5)));
+    vector<AABB> areas(queries);
+    vector<vec3> origins(queries),directions(queries);
+    for (size_t q = 0; q < queries; q++)
+    {
+        vec3 position(rand() % 2000 - 1000,rand() % 2000 - 1000,rand() % 2000 - 1000);
+        areas[q] = AABB(position,position + vec3(50.0f));
+        origins[q] = position;
+        directions[q] = glm::normalize(vec3(rand() % 200 - 100,rand() % 200 - 100,rand() % 200 - 100) + vec3(0.01f));
+    }
+
+    // The tree stores fattened boxes, exact hits are tested against the real box like a caller would
+    size_t treeHits = 0,bruteHits = 0;
+    auto timeQueries = [&](bool useTree,int kind)
+    {
+        size_t hits = 0;
+        auto start = Bench::Clock::now();
+        for (size_t q = 0; q < (kind == 0 ? 10 : queries); q++)
+        {
+            vec3 invDirection = vec3(1.0f) / directions[q];
+            auto test = [&](size_t i)
+            {
+                if (kind == 0) return Culling::boxVisible(frustum,boxes[i]) != Culling::OUTSIDE;
+                if (kind == 1) return boxes[i].overlaps(areas[q]);
+                return boxes[i].intersectsRay(origins[q],invDirection,300.0f);
+            };
+            if (!useTree)
+            {
+                for (size_t i = 0; i < count; i++) hits += test(i);
+            }
+            else if (kind == 0) tree.queryFrustum(frustum,[&](size_t i) { hits += test(i); });
+            else if (kind == 1) tree.queryAABB(areas[q],[&](size_t i) { hits += test(i); });
+            else tree.queryRay(origins[q],directions[q],300.0f,[&](size_t i) { hits += test(i); });
+        }
+        (useTree ? treeHits : bruteHits) = hits;
+        return double(kind == 0 ? 10 : queries) / (Bench::elapsedNs(start) * 1e-9);
+    };
+
+    const char* names[] = {"frustum","aabb","ray"};
+    cout << "aabb tree " << count << " models: refit " << refitNs << " ns/model (" << reinserted << " reinserted)" << endl;
+    for (int kind = 0; kind < 3; kind++)
+    {
+        double brute = timeQueries(false,kind);
+        double indexed = timeQueries(true,kind);
+        cout << "  " << names[kind] << " queries: brute force " << brute << " q/s, tree " << indexed << " q/s (x" << indexed / brute << ")"
+             << (treeHits == bruteHits ? "" : ", RESULTS DIFFER") << endl;
+    }
+}
+
+void benchClusterAssignment(size_t lightCount,int frames)
+{
+    mat4 projection = glm::perspective(glm::radians(90.0f),16.0f / 9.0f,0.1f,500.0f);
+    vector<vec3> positions(lightCount);
+    vector<float> radius(lightCount);
+    for (size_t i = 0; i < lightCount; i++)
+    {
+        positions[i] = vec3(rand() % 700 / 10.0f - 35.0f,rand() % 40 / 10.0f - 1.0f,rand() % 700 / 10.0f - 35.0f);
+        radius[i] = 3.0f;
+    }
+
+    Clusters::Assignment clusters;
+    clusters.buildBounds(projection);
+
+    double ns = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        mat4 view = glm::rotate(glm::translate(mat4(1.0),vec3(0,-2,-5)),f * 0.05f,vec3(0,1,0));
+        auto start = Bench::Clock::now();
+        clusters.assign(view,positions,radius);
+        ns += Bench::elapsedNs(start);
+    }
+
+    // Every light touching a cluster box must be in its list, checked against all the light/cluster pairs
+    mat4 view = glm::rotate(glm::translate(mat4(1.0),vec3(0,-2,-5)),(frames - 1) * 0.05f,vec3(0,1,0));
+    size_t expected = 0,maxPerCluster = 0,occupied = 0;
+    bool matches = true;
+    for (uint32_t c = 0; c < clusters.grid.count(); c++)
+    {
+        vector<uint32_t> brute;
+        for (uint32_t l = 0; l < lightCount; l++)
+        {
+            vec3 center = vec3(view * vec4(positions[l],1.0f));
+            vec3 closest = glm::clamp(center,clusters.clusterMin[c],clusters.clusterMax[c]) - center;
+            if (glm::dot(closest,closest) <= radius[l] * radius[l]) brute.push_back(l);
+        }
+        uint32_t offset = clusters.ranges[c * 2],count = clusters.ranges[c * 2 + 1];
+        matches &= vector<uint32_t>(clusters.indices.begin() + offset,clusters.indices.begin() + offset + count) == brute;
+        expected += brute.size();
+        maxPerCluster = std::max(maxPerCluster,brute.size());
+        occupied += !brute.empty();
+    }
+
+    cout << "cluster assignment " << lightCount << " lights, " << clusters.grid.count() << " clusters: " << ns / frames / 1e6 << " ms/frame, "
+         << double(expected) / std::max<size_t>(occupied,1) << " lights per lit cluster (max " << maxPerCluster << ", brute force would be " << lightCount << ")"
+         << (matches ? "" : ", RESULTS DIFFER") << endl;
+}
+
+// Insertion cost of the old sort-on-insert model list, lower_bound + vector::insert + shifting every later index
+double legacySortedInsertNs(const vector<uint64_t>& keys)
+{
+    vector<uint64_t> values;
+    vector<size_t> indexs;
+    auto start = Bench::Clock::now();
+    for (uint64_t key : keys)
+    {
+        auto it = lower_bound(values.begin(),values.end(),key);
+        size_t a = it - values.begin();
+        values.insert(it,key);
+        for (size_t i = a; i < indexs.size(); i++) indexs[i]++;
+        indexs.push_back(a);
+    }
+    return Bench::elapsedNs(start);
+}
+
+void benchRenderQueue(size_t count,int frames)
+{
+    RenderQueue queue;
+    vector<uint64_t> keys(count);
+    for (size_t i = 0; i < count; i++)
+        keys[i] = queue.makeKey(rand() % 8,rand() % 64,rand() % 16,(rand() % 5000) / 10.0f);
+
+    double radixNs = 0,stdNs = 0;
+    bool matches = true;
+    vector<RenderQueue::Entry> reference;
+    for (int f = 0; f < frames; f++)
+    {
+        queue.clear();
+        for (size_t i = 0; i < count; i++) queue.push(keys[i],i);
+        reference = queue.entries;
+
+        auto start = Bench::Clock::now();
+        queue.sort();
+        radixNs += Bench::elapsedNs(start);
+
+        start = Bench::Clock::now();
+        stable_sort(reference.begin(),reference.end(),[](const RenderQueue::Entry& a,const RenderQueue::Entry& b) { return a.key < b.key; });
+        stdNs += Bench::elapsedNs(start);
+
+        for (size_t i = 0; i < count; i++) matches &= reference[i].index == queue.entries[i].index;
+    }
+
+    cout << "render queue " << count << " draws: radix sort " << radixNs / frames / 1e6 << " ms, std::stable_sort " << stdNs / frames / 1e6 << " ms";
+    if (count <= 100000) cout << ", sorted insertion of the whole list " << legacySortedInsertNs(keys) / 1e6 << " ms";
+    cout << (matches ? "" : ", RESULTS DIFFER") << endl;
+}
+
+/*
+ * One draw of the demo scene as the renderer submits it: program, vertex array, culling, depth writes and the
+ * textures of its material with their sampler uniforms
+ */
+struct DemoDraw
+{
+    GLuint program,vertexArray;
+    bool cullBack,depthMask;
+    bool materialInstance;                      // Samplers set on every instance use instead of on program change
+    vector<GLint> samplers;                     // Sampler i reads units[i]
+    vector<pair<GLuint,GLenum>> units;
+    vector<GLuint> textures;
+};
+
+/*
+ * Submission before the state cache: cull face, program, unit bindings and vertex arrays were filtered each on their
+ * own, depth writes were switched off and back on around every masked draw and instance samplers were set every use
+ */
+namespace Legacy
+{
+    struct Submitter
+    {
+        bool lastCull = false;
+        GLuint program = -1,vertexArray = -1;
+        vector<GLuint> units = vector<GLuint>(16,-1);
+
+        void draw(const DemoDraw& draw)
+        {
+            if (lastCull != draw.cullBack)
+            {
+                glCullFace(GL_FRONT + draw.cullBack);
+                lastCull = draw.cullBack;
+            }
+            if (draw.depthMask) glDepthMask(GL_FALSE);
+
+            bool programChanged = program != draw.program;
+            if (programChanged) glUseProgram(program = draw.program);
+            for (size_t i = 0; i < draw.units.size(); i++)
+            {
+                if (units[draw.units[i].first] != draw.textures[i])
+                {
+                    units[draw.units[i].first] = draw.textures[i];
+                    glActiveTexture(GL_TEXTURE0 + draw.units[i].first);
+                    glBindTexture(draw.units[i].second,draw.textures[i]);
+                }
+                if (programChanged || draw.materialInstance) glUniform1i(draw.samplers[i],draw.units[i].first);
+            }
+            if (vertexArray != draw.vertexArray) glBindVertexArray(vertexArray = draw.vertexArray);
+            MockGL::draw();
+
+            if (draw.depthMask) glDepthMask(GL_TRUE);
+        }
+    };
+}
+
+void submitCached(GLStateCache& state,const DemoDraw& draw)
+{
+    state.setCullMode(draw.cullBack ? GL_BACK : GL_FRONT);
+    state.setDepthMask(!draw.depthMask);
+    state.useProgram(draw.program);
+    for (size_t i = 0; i < draw.units.size(); i++)
+    {
+        state.bindTexture(draw.units[i].first,draw.units[i].second,draw.textures[i]);
+        state.setSampler(draw.samplers[i],draw.units[i].first);
+    }
+    state.bindVertexArray(draw.vertexArray);
+    MockGL::draw();
+}
+
+/*
+ * GL state calls per frame of the demo scene (skybox, one instanced run of lit cubes, four unshaded light markers)
+ * before and after the state cache, every draw has to see the same state on both paths
+ */
+void benchStateCache(int frames)
+{
+    vector<DemoDraw> scene;
+    scene.push_back({7,1,true,true,false,{0},{{15,GL_TEXTURE_CUBE_MAP}},{4}});
+    scene.push_back({4,2,false,false,true,{0,1,2},{{0,GL_TEXTURE_2D},{1,GL_TEXTURE_2D},{2,GL_TEXTURE_2D}},{1,2,3}});
+    for (int i = 0; i < 4; i++) scene.push_back({3,2,false,false,true,{},{},{}});
+
+    // Calls of the first frame, average of the following ones and the state seen by every draw
+    struct Result
+    {
+        size_t firstFrame = 0;
+        double perFrame = 0;
+        vector<vector<size_t>> draws;
+    };
+
+    auto run = [&](auto beginFrame,auto submit)
+    {
+        MockGL::program = MockGL::vertexArray = MockGL::activeUnit = 0;
+        MockGL::textures.clear();
+        MockGL::uniforms.clear();
+        MockGL::depthMask = GL_TRUE;
+        MockGL::cullFace = GL_BACK;
+        MockGL::draws.clear();
+
+        Result result;
+        for (int f = 0; f < frames; f++)
+        {
+            MockGL::calls = 0;
+            beginFrame(f);
+            for (const DemoDraw& draw : scene) submit(draw);
+            if (f == 0) result.firstFrame = MockGL::calls;
+            else result.perFrame += double(MockGL::calls) / (frames - 1);
+        }
+        result.draws = MockGL::draws;
+        return result;
+    };
+
+    // Both start with the setup of render_loop
+    Legacy::Submitter legacy;
+    Result unfiltered = run([](int frame)
+    {
+        if (frame) return;
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);
+        glEnable(GL_DEPTH_TEST);
+    },[&](const DemoDraw& draw) { legacy.draw(draw); });
+
+    GLStateCache state;
+    Result cached = run([&](int frame)
+    {
+        if (frame == 0)
+        {
+            state.setCullFace(true);
+            state.setCullMode(GL_FRONT);
+            state.setDepthTest(true);
+        }
+        state.setDepthMask(true);
+    },[&](const DemoDraw& draw) { submitCached(state,draw); });
+
+    cout << "GL state calls of the demo scene: unfiltered " << unfiltered.firstFrame << " first frame, " << unfiltered.perFrame << " per frame, "
+         << "state cache " << cached.firstFrame << " first frame, " << cached.perFrame << " per frame"
+         << (unfiltered.draws == cached.draws ? "" : ", STATE DIFFERS") << endl;
+}
+
+/*
+ * Texture swaps per frame of count lit cubes with their own material instance, drawn in render queue order, with one
+ * 2D texture per unit and with the nine maps packed as layers of one texture array. Both have to sample the same maps
+ */
+void benchTextureArrays(size_t count,int frames)
+{
+    const size_t mapCount = 9,units = 3;
+    const GLuint arrayTexture = 100;
+    vector<array<GLuint,units>> instances(count);
+    for (size_t i = 0; i < count; i++)
+        for (size_t t = 0, digits = i; t < units; t++, digits /= mapCount) instances[i][t] = (digits + t) % mapCount;
+
+    // Swaps and layer uniform uploads per frame after the first, and whether every draw had its maps bound
+    struct Result
+    {
+        double swaps,layerUploads;
+        bool matches;
+    };
+
+    auto run = [&](bool packed)
+    {
+        GLStateCache state;
+        state.useProgram(1);
+        size_t swaps = 0,layerUploads = 0;
+        bool matches = true;
+        GLuint layersOf = -1;
+        for (int f = 0; f < frames; f++)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                for (GLuint t = 0; t < units; t++)
+                {
+                    bool swapped = packed ? state.bindTexture(t,GL_TEXTURE_2D_ARRAY,arrayTexture) : state.bindTexture(t,GL_TEXTURE_2D,instances[i][t]);
+                    if (f) swaps += swapped;
+                    state.setSampler(t,t);
+
+                    // Layer index is the map index when packed
+                    GLuint bound = MockGL::textures[{t,packed ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D}];
+                    matches &= packed ? bound == arrayTexture : bound == instances[i][t];
+                }
+                if (packed && layersOf != i)
+                {
+                    layersOf = i;
+                    if (f) layerUploads++;
+                }
+            }
+        }
+        double steadyFrames = std::max(frames - 1,1);
+        return Result{swaps / steadyFrames,layerUploads / steadyFrames,matches};
+    };
+
+    Result separate = run(false);
+    Result packed = run(true);
+    cout << "texture swaps, " << count << " materials: 2D textures " << separate.swaps << " per frame, texture array "
+         << packed.swaps << " per frame plus " << packed.layerUploads << " layer uniforms"
+         << (separate.matches && packed.matches ? "" : ", BINDINGS DIFFER") << endl;
+}
+
+/*
+ * Material instance switches of a frame drawn model by model, count lit cubes over 50 instances with a float, a color
+ * and three maps, then four light markers in a second program with one color each, the first animated. The old
+ * useInstance compared every slot and went through every assigned unit and sampler on each call, the tracked one
+ * uploads what the program hasn't seen. Every draw has to see the values and maps of its instance on both
+ */
+void benchUniformUpload(size_t count,int frames)
+{
+    struct Instance
+    {
+        float shinness;
+        vec4 color;
+        vector<GLuint> maps;
+        InstanceChanges changes;
+        bool forward[2] = {false,false};    // Old per uniform change flags
+    };
+    vector<Instance> instances;
+    for (size_t i = 0; i < 50; i++) instances.push_back({1.0f + i % 8,vec4(i / 50.0f),{GLuint(1 + i % 9),GLuint(10 + i % 7),GLuint(20 + i % 5)},{},{false,false}});
+    for (size_t i = 0; i < 4; i++) instances.push_back({0.0f,vec4(0.25f * i),{},{},{false,false}});
+
+    // Program 1 draws the cubes in instance order, program 2 the markers, locations 0 and 1 hold the two uniforms
+    vector<pair<GLuint,size_t>> draws;
+    for (size_t i = 0; i < count; i++) draws.push_back({1,i * 50 / count});
+    for (size_t i = 0; i < 4; i++) draws.push_back({2,50 + i});
+
+    struct Result
+    {
+        double uploads,requests,ns;
+        bool matches;
+    };
+
+    auto run = [&](auto useInstance)
+    {
+        GLStateCache state;
+        MockGL::values.clear();
+        MockGL::uniformUploads = 0;
+        size_t uploads = 0,requests = 0;
+        double ns = 0;
+        bool matches = true;
+        for (int f = 0; f < frames; f++)
+        {
+            Instance& animated = instances[50];
+            animated.color = vec4(f / float(frames));
+            animated.changes.markUniform(1);
+            animated.forward[1] = true;
+
+            size_t uploadsBefore = MockGL::uniformUploads,requestsBefore = state.calls + state.skipped;
+            Bench::Clock::time_point start = Bench::Clock::now();
+            GLuint program = -1;
+            for (const auto& draw : draws)
+            {
+                bool rebound = program != draw.first;
+                program = draw.first;
+                state.useProgram(program);
+                useInstance(state,program,rebound,draw.second);
+
+                const Instance& instance = instances[draw.second];
+                matches &= MockGL::values[{program,0}] == vec4(instance.shinness) && MockGL::values[{program,1}] == instance.color;
+                for (GLuint t = 0; t < instance.maps.size(); t++) matches &= MockGL::textures[{t,GL_TEXTURE_2D}] == instance.maps[t];
+            }
+            if (f)
+            {
+                ns += Bench::elapsedNs(start);
+                uploads += MockGL::uniformUploads - uploadsBefore;
+                requests += state.calls + state.skipped - requestsBefore - draws.size();
+            }
+        }
+        double steadyFrames = std::max(frames - 1,1);
+        return Result{uploads / steadyFrames,requests / steadyFrames,ns / steadyFrames / draws.size(),matches};
+    };
+
+    auto upload = [&](size_t slot,const Instance& instance)
+    {
+        if (slot == 0) glUniform1f(0,instance.shinness);
+        else glUniform4fv(1,1,&instance.color[0]);
+    };
+
+    vector<size_t> usedInstances[3] = {{size_t(-1),size_t(-1)},{size_t(-1),size_t(-1)},{size_t(-1),size_t(-1)}};
+    Result old = run([&](GLStateCache& state,GLuint program,bool,size_t id)
+    {
+        Instance& instance = instances[id];
+        for (size_t i = 0; i < 2; i++)
+        {
+            if (usedInstances[program][i] != id || instance.forward[i])
+            {
+                usedInstances[program][i] = id;
+                instance.forward[i] = false;
+                upload(i,instance);
+            }
+        }
+        for (GLuint t = 0; t < GLStateCache::maxTextureUnits; t++)
+        {
+            if (t >= instance.maps.size()) continue;
+            state.bindTexture(t,GL_TEXTURE_2D,instance.maps[t]);
+            state.setSampler(2 + t,t);
+        }
+    });
+
+    BoundInstance bound[3];
+    Result tracked = run([&](GLStateCache& state,GLuint program,bool rebound,size_t id)
+    {
+        const Instance& instance = instances[id];
+        if (rebound) bound[program].texturesBound = false;
+
+        uint64_t uniformBits;
+        uint32_t textureBits;
+        if (!bound[program].update(id,instance.changes,lowBits(2),uint32_t(lowBits(instance.maps.size())),uniformBits,textureBits)) return;
+        forEachBit(uniformBits,[&](size_t i) { upload(i,instance); });
+        forEachBit(textureBits,[&](size_t t) { state.bindTexture(t,GL_TEXTURE_2D,instance.maps[t]); });
+    });
+
+    cout << "material instance switches, " << draws.size() << " draws: per slot compare " << old.uploads << " uniform uploads, "
+         << old.requests << " texture and sampler requests, " << old.ns << " ns per draw, tracked " << tracked.uploads
+         << " uniform uploads, " << tracked.requests << " texture and sampler requests, " << tracked.ns << " ns per draw"
+         << (old.matches && tracked.matches ? "" : ", VALUES DIFFER") << endl;
+}
+
+/*
+ * Change tracking before the per slot versions, one mask of every slot ever set, so any later change uploaded all of them
+ */
+namespace Legacy
+{
+    struct InstanceChanges
+    {
+        uint64_t uniforms = 0;
+        uint32_t version = 0;
+
+        inline void markUniform(size_t slot)
+        {
+            uniforms |= uint64_t(1) << slot;
+            version++;
+        }
+    };
+}
+
+/*
+ * One instance of slots uniforms drawn draws times a frame by one program. The first frame sets every slot, the
+ * following ones one slot each in turn. The mask of every slot ever set uploads all of them on each change, the
+ * per slot versions only the slot set. The program has to see the last value of every slot on both
+ */
+void benchSlotVersions(size_t slots,size_t draws,int frames)
+{
+    vector<float> values(slots,0.0f);
+    auto run = [&](auto markUniform,auto uploadedSlots)
+    {
+        GLStateCache state;
+        MockGL::values.clear();
+        state.useProgram(1);
+        size_t uploadsBefore = MockGL::uniformUploads;
+        bool matches = true;
+        for (int f = 0; f < frames; f++)
+        {
+            for (size_t slot = 0; slot < slots; slot++)
+            {
+                if (f != 0 && slot != f % slots) continue;
+                values[slot] = float(f * slots + slot);
+                markUniform(slot);
+            }
+            for (size_t d = 0; d < draws; d++)
+            {
+                forEachBit(uploadedSlots(),[&](size_t slot) { glUniform1f(slot,values[slot]); });
+                for (size_t slot = 0; slot < slots; slot++) matches &= MockGL::values[{1,GLint(slot)}] == vec4(values[slot]);
+            }
+        }
+        return make_pair(double(MockGL::uniformUploads - uploadsBefore) / frames,matches);
+    };
+
+    Legacy::InstanceChanges mask;
+    uint32_t maskVersion = 0;
+    bool maskBound = false;
+    auto legacy = run([&](size_t slot) { mask.markUniform(slot); },[&]()
+    {
+        uint64_t bits = !maskBound ? lowBits(slots) : maskVersion != mask.version ? mask.uniforms : 0;
+        maskBound = true;
+        maskVersion = mask.version;
+        return bits;
+    });
+
+    InstanceChanges changes;
+    BoundInstance bound;
+    auto versioned = run([&](size_t slot) { changes.markUniform(slot); },[&]()
+    {
+        uint64_t uniformBits;
+        uint32_t textureBits;
+        bound.update(0,changes,lowBits(slots),0,uniformBits,textureBits);
+        return uniformBits;
+    });
+
+    cout << "instance slot changes, " << slots << " slots, " << frames << " frames: mask of set slots " << legacy.first
+         << " uniform uploads per frame, per slot versions " << versioned.first << (legacy.second && versioned.second ? "" : ", VALUES DIFFER") << endl;
+}
+
+/*
+ * Upload before the per slot routines, a switch on the type of every value. BOOL and INT fell through without uploading
+ */
+namespace Legacy
+{
+    inline void useUniform(const Uniform& current,GLint location)
+    {
+        switch(current.type)
+        {
+            case UniformType::VEC2:
+            glUniform2fv(location,1,&current.get<vec2>()[0]); break;
+            case UniformType::VEC3:
+            glUniform3fv(location,1,&current.get<vec3>()[0]); break;
+            case UniformType::VEC4:
+            glUniform4fv(location,1,&current.get<vec4>()[0]); break;
+            case UniformType::MAT2:
+            glUniformMatrix2fv(location,1,false,&current.get<mat2>()[0][0]); break;
+            case UniformType::MAT3:
+            glUniformMatrix3fv(location,1,false,&current.get<mat3>()[0][0]); break;
+            case UniformType::MAT4:
+            glUniformMatrix4fv(location,1,false,&current.get<mat4>()[0][0]); break;
+            case UniformType::FLOAT:
+            glUniform1f(location,current.get<float>()); break;
+            case UniformType::BOOL:
+            default:
+            break;
+        }
+    }
+}
+
+/*
+ * Every slot of count instances of a material declaring one uniform of each type in a shuffled order, uploaded with the
+ * type switch from the values and with the routines the material picked per slot from the std140 blocks the instances
+ * pack them in. Uploads go to counting stubs, the routines have to upload every slot, BOOL and INT too, with the
+ * values a direct upload of each type gives
+ */
+void benchUniformDispatch(size_t count,int repeats)
+{
+    vector<UniformType> slotTypes;
+    for (int type = 0; type < UNIFORM_TYPE_COUNT; type++) slotTypes.push_back(UniformType(type));
+    for (size_t i = slotTypes.size() - 1; i > 0; i--) swap(slotTypes[i],slotTypes[rand() % (i + 1)]);
+
+    vector<UniformUploader> uploaders;
+    for (UniformType type : slotTypes) uploaders.push_back(uniformUploaders[type]);
+
+    auto value = [](){ return (rand() % 1000) / 100.0f; };
+    vector<vector<Uniform>> instances(count);
+    for (vector<Uniform>& instance : instances)
+    {
+        for (UniformType type : slotTypes)
+        {
+            switch (type)
+            {
+                case VEC2: instance.push_back(vec2(value(),value())); break;
+                case VEC3: instance.push_back(vec3(value(),value(),value())); break;
+                case VEC4: instance.push_back(vec4(value(),value(),value(),value())); break;
+                case MAT2: instance.push_back(mat2(value())); break;
+                case MAT3: instance.push_back(mat3(value())); break;
+                case MAT4: instance.push_back(mat4(value())); break;
+                case FLOAT: instance.push_back(value()); break;
+                case BOOL: instance.push_back(rand() % 2 == 0); break;
+                default: instance.push_back(rand() % 100); break;
+            }
+        }
+    }
+
+    UniformBlockLayout packing(slotTypes);
+    vector<uint8_t> blocks(count * packing.size);
+    for (size_t i = 0; i < count; i++)
+        for (size_t slot = 0; slot < slotTypes.size(); slot++)
+            uniformPackers[slotTypes[slot]](&blocks[i * packing.size + packing.offsets[slot]],instances[i][slot]);
+
+    // Reference checksum of one pass, uploading each value through the overload of its type
+    MockGL::keepValues = false;
+    MockGL::checksum = 0;
+    for (const vector<Uniform>& instance : instances)
+    {
+        for (GLint slot = 0; slot < GLint(slotTypes.size()); slot++)
+        {
+            const Uniform& uniform = instance[slot];
+            switch (slotTypes[slot])
+            {
+                case VEC2: uploadUniform(slot,uniform.get<vec2>()); break;
+                case VEC3: uploadUniform(slot,uniform.get<vec3>()); break;
+                case VEC4: uploadUniform(slot,uniform.get<vec4>()); break;
+                case MAT2: uploadUniform(slot,uniform.get<mat2>()); break;
+                case MAT3: uploadUniform(slot,uniform.get<mat3>()); break;
+                case MAT4: uploadUniform(slot,uniform.get<mat4>()); break;
+                case FLOAT: uploadUniform(slot,uniform.get<float>()); break;
+                case BOOL: uploadUniform(slot,uniform.get<bool>()); break;
+                default: uploadUniform(slot,uniform.get<int>()); break;
+            }
+        }
+    }
+    double reference = MockGL::checksum;
+
+    auto run = [&](auto upload)
+    {
+        size_t calls = MockGL::calls;
+        MockGL::checksum = 0;
+        double best = 1e30;
+        for (int r = 0; r < repeats; r++)
+        {
+            Bench::Clock::time_point start = Bench::Clock::now();
+            for (size_t i = 0; i < count; i++)
+                for (GLint slot = 0; slot < GLint(slotTypes.size()); slot++) upload(slot,i);
+            best = std::min(best,Bench::elapsedNs(start));
+        }
+        double uploads = double(MockGL::calls - calls) / repeats;
+        return make_tuple(best / uploads,uploads,MockGL::checksum / repeats);
+    };
+
+    double switchNs,switchUploads,switchChecksum,tableNs,tableUploads,tableChecksum;
+    tie(switchNs,switchUploads,switchChecksum) = run([&](GLint slot,size_t i) { Legacy::useUniform(instances[i][slot],slot); });
+    tie(tableNs,tableUploads,tableChecksum) = run([&](GLint slot,size_t i) { uploaders[slot](slot,&blocks[i * packing.size + packing.offsets[slot]]); });
+    MockGL::keepValues = true;
+
+    cout << "uniform uploads, " << count << " instances of " << slotTypes.size() << " slots: type switch " << switchUploads << " uploads, "
+         << switchNs << " ns per upload, per slot routines " << tableUploads << " uploads, " << tableNs << " ns per upload"
+         << (std::abs(tableChecksum - reference) <= 1e-6 * std::abs(reference) ? "" : ", VALUES DIFFER") << endl;
+}
+
+/*
+ * Material instances before the std140 blocks: every value in a Uniform big enough for a mat4 and sixteen texture units
+ */
+namespace Legacy
+{
+    struct MaterialInstance
+    {
+        vector<Uniform> uniformValues;
+        vector<size_t> assignedTextureUnits;
+        uint32_t textureUnits = 0;
+        InstanceChanges changes;
+
+        MaterialInstance(const vector<Uniform>& values) : uniformValues(values),assignedTextureUnits(16,-1) { }
+    };
+}
+
+/*
+ * Instance values packed std140 in one block per instance against the offsets a GL compiler gives the same block,
+ * then count instances of a lit material (shinness, color, a mat3 and three maps) kept both ways, and a frame of
+ * draws in instance order switching the loose uniforms through BoundInstance against one range binding of a shared
+ * buffer. Every draw has to see its own values on both
+ */
+void benchInstanceBlocks(size_t count,int frames)
+{
+    const vector<pair<vector<UniformType>,vector<uint32_t>>> expected = {
+        {{VEC3,FLOAT},{0,12,16}},
+        {{FLOAT,VEC3},{0,16,32}},
+        {{MAT3,FLOAT},{0,48,64}},
+        {{VEC2,VEC2,MAT2,BOOL,INT},{0,8,16,48,52,64}},
+        {{FLOAT,VEC2,VEC4,MAT4,VEC3},{0,8,16,32,96,112}},
+    };
+    bool layoutsMatch = true;
+    for (const auto& block : expected)
+    {
+        UniformBlockLayout packing(block.first);
+        vector<uint32_t> offsets = packing.offsets;
+        offsets.push_back(packing.size);
+        layoutsMatch &= offsets == block.second;
+    }
+
+    vector<vector<Uniform>> values(count);
+    for (size_t i = 0; i < count; i++) values[i] = {1.0f + i % 8,vec4(i / float(1 + i % 50)),mat3(float(i))};
+
+    size_t bytesBefore = Bench::allocatedBytes;
+    vector<Legacy::MaterialInstance> legacy;
+    legacy.reserve(count);
+    for (size_t i = 0; i < count; i++) legacy.emplace_back(values[i]);
+    size_t legacyBytes = Bench::allocatedBytes - bytesBefore;
+
+    // One layout shared by all, the blocks back to back in one array and the three units each instance uses
+    struct Packed
+    {
+        vector<uint8_t> block;              // Empty once shared
+        vector<size_t> assignedTextureUnits;
+        uint32_t layout = 0,textureUnits = 0,blockOffset = 0,bufferOffset = 0;
+        bool shared = true;
+        InstanceChanges changes;
+
+        inline const uint8_t* data(const vector<uint8_t>& blocks) const { return blocks.data() + blockOffset; }
+    };
+    UniformBlockLayout packing({FLOAT,VEC4,MAT3});
+    const GLsizeiptr alignment = 256;
+    bytesBefore = Bench::allocatedBytes;
+    vector<uint8_t> sharedBlocks(count * packing.size);
+    vector<Packed> packed(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        packed[i].blockOffset = i * packing.size;
+        for (size_t slot = 0; slot < values[i].size(); slot++)
+            uniformPackers[values[i][slot].type](&sharedBlocks[packed[i].blockOffset + packing.offsets[slot]],values[i][slot]);
+        packed[i].assignedTextureUnits.assign(3,-1);
+        packed[i].bufferOffset = (packing.size + alignment - 1) / alignment * alignment * i;
+    }
+    size_t packedBytes = Bench::allocatedBytes - bytesBefore;
+    size_t bufferBytes = (packing.size + alignment - 1) / alignment * alignment * count;
+
+    struct Result
+    {
+        double calls,ns;
+        bool matches;
+    };
+    auto run = [&](auto useInstance,auto sees)
+    {
+        GLStateCache state;
+        MockGL::values.clear();
+        MockGL::uniformRanges.clear();
+        state.useProgram(1);
+        size_t calls = 0;
+        double ns = 0;
+        bool matches = true;
+        for (int f = 0; f < frames; f++)
+        {
+            size_t callsBefore = MockGL::calls;
+            Bench::Clock::time_point start = Bench::Clock::now();
+            for (size_t i = 0; i < count; i++)
+            {
+                useInstance(state,i);
+                matches &= sees(i);
+            }
+            ns += Bench::elapsedNs(start);
+            calls += MockGL::calls - callsBefore;
+        }
+        return Result{double(calls) / frames,ns / frames / count,matches};
+    };
+
+    BoundInstance bound;
+    vector<UniformUploader> uploaders;
+    for (UniformType type : packing.types) uploaders.push_back(uniformUploaders[type]);
+    Result loose = run([&](GLStateCache&,size_t i)
+    {
+        uint64_t uniformBits;
+        uint32_t textureBits;
+        if (!bound.update(i,packed[i].changes,lowBits(3),0,uniformBits,textureBits)) return;
+        forEachBit(uniformBits,[&](size_t slot) { uploaders[slot](slot,packed[i].data(sharedBlocks) + packing.offsets[slot]); });
+    },
+    [&](size_t i)
+    {
+        return MockGL::values[{1,0}] == vec4(legacy[i].uniformValues[0].get<float>()) &&
+               MockGL::values[{1,1}] == legacy[i].uniformValues[1].get<vec4>();
+    });
+    Result ranges = run([&](GLStateCache& state,size_t i) { state.bindUniformRange(1,1,packed[i].bufferOffset,packing.size); },
+    [&](size_t i) { return MockGL::uniformRanges[1] == make_pair(GLintptr(packed[i].bufferOffset),GLsizeiptr(packing.size)); });
+
+    cout << "instance blocks: std140 offsets " << (layoutsMatch ? "match" : "DIFFER") << ", " << count << " instances take "
+         << legacyBytes / count << " bytes each as uniform values, " << packedBytes / count << " packed plus "
+         << bufferBytes / count << " of buffer, switching in a frame takes " << loose.calls << " uniform uploads, "
+         << loose.ns << " ns per draw, or " << ranges.calls << " range bindings, " << ranges.ns << " ns per draw"
+         << (loose.matches && ranges.matches ? "" : ", VALUES DIFFER") << endl;
+}
+
+/*
+ * Command list recording of count sorted draws on one thread and split over all threads. Replaying the parallel
+ * lists in order has to give every draw the same material, instance, mesh, raster state and transform
+ */
+void benchCommandRecording(size_t count,int frames)
+{
+    struct Draw
+    {
+        uint32_t material,instance,mesh;
+        bool cullBack,depthMask;
+        mat4 transform;
+        mat3 normal;
+    };
+    vector<Draw> draws(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        draws[i] = {uint32_t(rand() % 8),uint32_t(rand() % 64),uint32_t(rand() % 16),rand() % 8 == 0,rand() % 64 == 0,Bench::randomTransform(),mat3(1.0f)};
+        draws[i].normal = mat3(glm::transpose(glm::inverse(draws[i].transform)));
+    }
+    sort(draws.begin(),draws.end(),[](const Draw& a,const Draw& b) { return make_tuple(a.material,a.instance,a.mesh) < make_tuple(b.material,b.instance,b.mesh); });
+
+    auto record = [&](vector<CommandList>& lists)
+    {
+        int threads = lists.size();
+        #pragma omp parallel for num_threads(threads) schedule(static,1)
+        for (int t = 0; t < threads; t++)
+        {
+            lists[t].clear();
+            CommandRecorder recorder(lists[t]);
+            for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++)
+            {
+                recorder.setRaster(draws[i].cullBack,draws[i].depthMask);
+                recorder.useMaterial(draws[i].material);
+                recorder.useMaterialInstance(draws[i].instance);
+                recorder.useMesh(draws[i].mesh);
+                recorder.setObject(draws[i].transform,draws[i].normal);
+                recorder.draw();
+            }
+        }
+    };
+
+    // Decodes the lists back to the state every draw sees
+    auto replay = [&](const vector<CommandList>& lists)
+    {
+        vector<Draw> seen;
+        Draw state = {};
+        for (const CommandList& list : lists)
+        {
+            CommandList::Reader reader = list.reader();
+            CommandList::Opcode opcode;
+            while (reader.next(opcode))
+            {
+                switch (opcode)
+                {
+                    case CommandList::USE_MATERIAL: state.material = reader.read<uint32_t>(); state.instance = -1; break;
+                    case CommandList::USE_MATERIAL_INSTANCE: state.instance = reader.read<uint32_t>(); break;
+                    case CommandList::USE_MESH: state.mesh = reader.read<uint32_t>(); break;
+                    case CommandList::SET_RASTER: state.cullBack = reader.read<uint8_t>(); state.depthMask = reader.read<uint8_t>(); break;
+                    case CommandList::SET_OBJECT: state.transform = reader.read<mat4>(); state.normal = reader.read<mat3>(); break;
+                    case CommandList::DRAW: seen.push_back(state); break;
+                    case CommandList::DRAW_INSTANCED: reader.read<uint32_t>(); reader.read<uint32_t>(); break;
+                }
+            }
+        }
+        return seen;
+    };
+
+    int threads = 1;
+    #ifdef _OPENMP
+    threads = omp_get_max_threads();
+    #endif
+    vector<CommandList> single(1),parallel(threads);
+    double singleNs = 0,parallelNs = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        auto start = Bench::Clock::now();
+        record(single);
+        singleNs += Bench::elapsedNs(start);
+
+        start = Bench::Clock::now();
+        record(parallel);
+        parallelNs += Bench::elapsedNs(start);
+    }
+
+    size_t bytes = 0;
+    for (const CommandList& list : parallel) bytes += list.stream.size();
+    vector<Draw> seen = replay(parallel);
+    bool matches = seen.size() == count;
+    for (size_t i = 0; i < count && matches; i++)
+        matches = seen[i].material == draws[i].material && seen[i].instance == draws[i].instance && seen[i].mesh == draws[i].mesh &&
+                  seen[i].cullBack == draws[i].cullBack && seen[i].depthMask == draws[i].depthMask &&
+                  !memcmp(&seen[i].transform,&draws[i].transform,sizeof(mat4)) && !memcmp(&seen[i].normal,&draws[i].normal,sizeof(mat3));
+
+    cout << "command recording " << count << " draws: 1 thread " << singleNs / frames / 1e6 << " ms, " << threads << " threads "
+         << parallelNs / frames / 1e6 << " ms, " << bytes / count << " bytes per draw" << (matches ? "" : ", RESULTS DIFFER") << endl;
+}
+
+/*
+ * State changes against depth order of count draws sorted with state first keys, front to back bucketed keys and
+ * depth alone. Depth order is measured as the mean depth of the draws in the first and last quarter of the queue
+ */
+void benchFrontToBack(size_t count)
+{
+    RenderQueue state,bucketed,depthOnly;
+    vector<float> depths(count);
+    vector<size_t> states(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t material = rand() % 4,instance = rand() % 8,mesh = rand() % 4;
+        states[i] = (material * 8 + instance) * 4 + mesh;
+        depths[i] = (rand() % 2000) / 10.0f;
+        state.push(state.makeKey(material,instance,mesh,depths[i]),i);
+        bucketed.push(bucketed.makeFrontToBackKey(material,instance,mesh,depths[i]),i);
+        depthOnly.push(depthOnly.makeKey(0,0,0,depths[i]),i);
+    }
+
+    auto report = [&](const char* name,RenderQueue& queue)
+    {
+        queue.sort();
+        size_t changes = 0;
+        for (size_t i = 1; i < count; i++) changes += states[queue[i]] != states[queue[i - 1]];
+
+        double front = 0,back = 0;
+        for (size_t i = 0; i < count / 4; i++)
+        {
+            front += depths[queue[i]];
+            back += depths[queue[count - 1 - i]];
+        }
+        cout << "  " << name << ": " << changes << " state changes, first quarter at depth " << front / (count / 4) << ", last quarter at " << back / (count / 4) << endl;
+    };
+
+    cout << "front to back ordering, " << count << " draws:" << endl;
+    report("state sorted",state);
+    report("front to back buckets",bucketed);
+    report("depth only",depthOnly);
+}
+
+int main()
+{
+    srand(42);
+
+    benchHierarchyUpdate(10000,100);
+    benchHierarchyUpdate(100000,20);
+    benchHierarchyUpdate(1000000,5);
+
+    benchDirtyUpdate(1000000,0.0001f,10);
+    benchDirtyUpdate(1000000,0.01f,10);
+
+    benchParallelUpdate("deep",Bench::deepParents(1000000),10);
+    benchParallelUpdate("wide",Bench::wideParents(1000000),10);
+
+    benchSpatialChurn(100000,100000,60);
+
+    benchMatrixKernels(100003,20);
+
+    benchFrustumCulling(100003,20);
+
+    benchAABBTree(1000,1000);
+    benchAABBTree(10000,1000);
+    benchAABBTree(100000,1000);
+
+    benchClusterAssignment(1024,60);
+    benchClusterAssignment(4096,60);
+
+    benchRenderQueue(1000,100);
+    benchRenderQueue(100000,20);
+    benchRenderQueue(1000000,5);
+    benchFrontToBack(10000);
+
+    benchStateCache(60);
+    benchTextureArrays(200,60);
+    benchUniformUpload(1000,60);
+    benchSlotVersions(4,100,60);
+    benchUniformDispatch(10000,20);
+    benchInstanceBlocks(10000,20);
+
+    benchCommandRecording(10000,100);
+    benchCommandRecording(100000,20);
+    return 0;
+}
@@ -0,0 +1,412 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "culling.h"
+
+struct AABB
+{
+    glm::vec3 min,max;
+
+    AABB() : min(INFINITY), max(-INFINITY) { }
+    AABB(const glm::vec3& _min,const glm::vec3& _max) : min(_min), max(_max) { }
+
+    inline static AABB merge(const AABB& a,const AABB& b) { return AABB(glm::min(a.min,b.min),glm::max(a.max,b.max)); }
+
+    inline float area() const
+    {
+        glm::vec3 d = max - min;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    inline bool contains(const AABB& other) const
+    {
+        return min.x <= other.min.x && min.y <= other.min.y && min.z <= other.min.z &&
+               max.x >= other.max.x && max.y >= other.max.y && max.z >= other.max.z;
+    }
+
+    inline bool overlaps(const AABB& other) const
+    {
+        return min.x <= other.max.x && min.y <= other.max.y && min.z <= other.max.z &&
+               max.x >= other.min.x && max.y >= other.min.y && max.z >= other.min.z;
+    }
+
+    // True if any face of this box lies on the matching face of outer, shrinking it may shrink outer
+    inline bool touches(const AABB& outer) const
+    {
+        return min.x <= outer.min.x || min.y <= outer.min.y || min.z <= outer.min.z ||
+               max.x >= outer.max.x || max.y >= outer.max.y || max.z >= outer.max.z;
+    }
+
+    inline AABB fattened(float margin) const { return AABB(min - glm::vec3(margin),max + glm::vec3(margin)); }
+
+    inline glm::vec3 center() const { return (min + max) * 0.5f; }
+
+    // Slab test, true if the ray enters the box before maxDistance
+    inline bool intersectsRay(const glm::vec3& origin,const glm::vec3& invDirection,float maxDistance) const
+    {
+        float tmin = 0.0f,tmax = maxDistance;
+        for (int a = 0; a < 3; a++)
+        {
+            float t0 = (min[a] - origin[a]) * invDirection[a];
+            float t1 = (max[a] - origin[a]) * invDirection[a];
+            tmin = glm::max(tmin,glm::min(t0,t1));
+            tmax = glm::min(tmax,glm::max(t0,t1));
+        }
+        return tmin <= tmax;
+    }
+
+    /*
+     * Bounds of the 8 transformed corners of a local box, computed from the center and the absolute matrix (Arvo)
+     */
+    static AABB transform(const glm::mat4& m,const glm::vec3& localMin,const glm::vec3& localMax)
+    {
+        glm::vec3 center = glm::vec3(m * glm::vec4((localMin + localMax) * 0.5f,1.0f));
+        glm::vec3 extent = (localMax - localMin) * 0.5f;
+        glm::vec3 worldExtent;
+        for (int r = 0; r < 3; r++)
+            worldExtent[r] = std::abs(m[0][r]) * extent.x + std::abs(m[1][r]) * extent.y + std::abs(m[2][r]) * extent.z;
+        return AABB(center - worldExtent,center + worldExtent);
+    }
+};
+
+namespace Culling
+{
+    enum Containment { OUTSIDE = 0, INTERSECTS, INSIDE };
+
+    inline Containment boxVisible(const Frustum& frustum,const AABB& box)
+    {
+        Containment result = INSIDE;
+        for (const auto& plane : frustum.planes)
+        {
+            glm::vec3 positive(plane.x > 0 ? box.max.x : box.min.x,plane.y > 0 ? box.max.y : box.min.y,plane.z > 0 ? box.max.z : box.min.z);
+            glm::vec3 negative(plane.x > 0 ? box.min.x : box.max.x,plane.y > 0 ? box.min.y : box.max.y,plane.z > 0 ? box.min.z : box.max.z);
+            if (glm::dot(glm::vec3(plane),positive) + plane.w < 0.0f) return OUTSIDE;
+            if (glm::dot(glm::vec3(plane),negative) + plane.w < 0.0f) result = INTERSECTS;
+        }
+        return result;
+    }
+}
+
+/*
+ * Dynamic bounding volume hierarchy over fattened boxes. Leaves are inserted next to the sibling with the cheapest
+ * surface area growth and the tree is kept balanced with rotations, moving a proxy only reinserts it once it leaves
+ * its fat box. Node storage is a vector with a free list, proxies are stable node indexs.
+ */
+struct DynamicAABBTree
+{
+    const static size_t nullNode = -1;
+    const static int maxStack = 256;
+
+    struct Node
+    {
+        AABB box;
+        size_t parent,left,right;
+        int height;
+        size_t userData;
+
+        inline bool isLeaf() const { return left == nullNode; }
+    };
+
+    /*
+     * Depth first traversal stack. Rotations keep the height near 1.44 log2 of the leaves so maxStack is never reached
+     * in practice, a deeper tree spills the rest of the stack to the heap instead of writing past it
+     */
+    struct Stack
+    {
+        size_t fixed[maxStack];
+        std::vector<size_t> spill;
+        int top = 0;
+
+        inline void push(size_t index)
+        {
+            if (top < maxStack) fixed[top++] = index;
+            else spill.push_back(index);
+        }
+
+        inline size_t pop()
+        {
+            if (spill.empty()) return fixed[--top];
+            size_t index = spill.back();
+            spill.pop_back();
+            return index;
+        }
+
+        inline bool empty() const { return top == 0; }
+    };
+
+    std::vector<Node> nodes;
+    std::vector<size_t> freeNodes;
+    size_t root = nullNode;
+    size_t leafCount = 0;
+    float margin;
+
+    DynamicAABBTree(float _margin = 0.1f) : margin(_margin) { }
+
+    size_t insert(const AABB& box,size_t userData)
+    {
+        size_t leaf = allocateNode();
+        nodes[leaf].box = box.fattened(margin);
+        nodes[leaf].userData = userData;
+        nodes[leaf].height = 0;
+        insertLeaf(leaf);
+        leafCount++;
+        return leaf;
+    }
+
+    void remove(size_t proxy)
+    {
+        removeLeaf(proxy);
+        freeNode(proxy);
+        leafCount--;
+    }
+
+    /*
+     * Refits a proxy to a new box, returns true if it had to be reinserted
+     */
+    bool move(size_t proxy,const AABB& box)
+    {
+        if (nodes[proxy].box.contains(box)) return false;
+
+        removeLeaf(proxy);
+        nodes[proxy].box = box.fattened(margin);
+        insertLeaf(proxy);
+        return true;
+    }
+
+    inline const AABB& getBox(size_t proxy) const { return nodes[proxy].box; }
+
+    template <typename F>
+    void queryAABB(const AABB& box,F callback) const
+    {
+        if (root == nullNode) return;
+
+        Stack stack;
+        stack.push(root);
+        while (!stack.empty())
+        {
+            const Node& node = nodes[stack.pop()];
+            if (!node.box.overlaps(box)) continue;
+            if (node.isLeaf()) callback(node.userData);
+            else
+            {
+                stack.push(node.left);
+                stack.push(node.right);
+            }
+        }
+    }
+
+    template <typename F>
+    void queryFrustum(const Culling::Frustum& frustum,F callback) const
+    {
+        if (root == nullNode) return;
+
+        Stack stack;
+        stack.push(root);
+        while (!stack.empty())
+        {
+            size_t index = stack.pop();
+            Culling::Containment containment = Culling::boxVisible(frustum,nodes[index].box);
+            if (containment == Culling::OUTSIDE) continue;
+            if (containment == Culling::INSIDE) reportSubtree(index,callback);
+            else if (nodes[index].isLeaf()) callback(nodes[index].userData);
+            else
+            {
+                stack.push(nodes[index].left);
+                stack.push(nodes[index].right);
+            }
+        }
+    }
+
+    template <typename F>
+    void queryRay(const glm::vec3& origin,const glm::vec3& direction,float maxDistance,F callback) const
+    {
+        if (root == nullNode) return;
+
+        glm::vec3 invDirection = glm::vec3(1.0f) / direction;
+        Stack stack;
+        stack.push(root);
+        while (!stack.empty())
+        {
+            const Node& node = nodes[stack.pop()];
+            if (!node.box.intersectsRay(origin,invDirection,maxDistance)) continue;
+            if (node.isLeaf()) callback(node.userData);
+            else
+            {
+                stack.push(node.left);
+                stack.push(node.right);
+            }
+        }
+    }
+
+    private:
+
+    template <typename F>
+    void reportSubtree(size_t index,F& callback) const
+    {
+        Stack stack;
+        stack.push(index);
+        while (!stack.empty())
+        {
+            const Node& node = nodes[stack.pop()];
+            if (node.isLeaf()) callback(node.userData);
+            else
+            {
+                stack.push(node.left);
+                stack.push(node.right);
+            }
+        }
+    }
+
+    size_t allocateNode()
+    {
+        size_t index;
+        if (!freeNodes.empty())
+        {
+            index = freeNodes.back();
+            freeNodes.pop_back();
+        }
+        else
+        {
+            index = nodes.size();
+            nodes.emplace_back();
+        }
+        nodes[index].parent = nodes[index].left = nodes[index].right = nullNode;
+        nodes[index].height = 0;
+        return index;
+    }
+
+    inline void freeNode(size_t index)
+    {
+        nodes[index].height = -1;
+        freeNodes.push_back(index);
+    }
+
+    inline void refit(size_t index)
+    {
+        Node& node = nodes[index];
+        node.height = 1 + glm::max(nodes[node.left].height,nodes[node.right].height);
+        node.box = AABB::merge(nodes[node.left].box,nodes[node.right].box);
+    }
+
+    inline void replaceChild(size_t parent,size_t oldChild,size_t newChild)
+    {
+        if (parent == nullNode) root = newChild;
+        else if (nodes[parent].left == oldChild) nodes[parent].left = newChild;
+        else nodes[parent].right = newChild;
+    }
+
+    void insertLeaf(size_t leaf)
+    {
+        if (root == nullNode)
+        {
+            root = leaf;
+            nodes[leaf].parent = nullNode;
+            return;
+        }
+
+        // Descend towards the sibling with the lowest surface area cost
+        AABB leafBox = nodes[leaf].box;
+        size_t index = root;
+        while (!nodes[index].isLeaf())
+        {
+            const Node& node = nodes[index];
+            float area = node.box.area();
+            float combinedArea = AABB::merge(node.box,leafBox).area();
+
+            float cost = 2.0f * combinedArea;
+            float inheritance = 2.0f * (combinedArea - area);
+
+            auto descendCost = [&](size_t child)
+            {
+                float merged = AABB::merge(leafBox,nodes[child].box).area();
+                return (nodes[child].isLeaf() ? merged : merged - nodes[child].box.area()) + inheritance;
+            };
+            float costLeft = descendCost(node.left);
+            float costRight = descendCost(node.right);
+
+            if (cost < costLeft && cost < costRight) break;
+            index = costLeft < costRight ? node.left : node.right;
+        }
+
+        size_t sibling = index;
+        size_t oldParent = nodes[sibling].parent;
+        size_t newParent = allocateNode();
+        nodes[newParent].parent = oldParent;
+        nodes[newParent].left = sibling;
+        nodes[newParent].right = leaf;
+        nodes[newParent].box = AABB::merge(leafBox,nodes[sibling].box);
+        nodes[newParent].height = nodes[sibling].height + 1;
+        nodes[sibling].parent = newParent;
+        nodes[leaf].parent = newParent;
+        replaceChild(oldParent,sibling,newParent);
+
+        for (index = nodes[leaf].parent; index != nullNode; index = nodes[index].parent)
+        {
+            index = balance(index);
+            refit(index);
+        }
+    }
+
+    void removeLeaf(size_t leaf)
+    {
+        if (leaf == root)
+        {
+            root = nullNode;
+            return;
+        }
+
+        size_t parent = nodes[leaf].parent;
+        size_t grandParent = nodes[parent].parent;
+        size_t sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+        replaceChild(grandParent,parent,sibling);
+        nodes[sibling].parent = grandParent;
+        freeNode(parent);
+
+        for (size_t index = grandParent; index != nullNode; index = nodes[index].parent)
+        {
+            index = balance(index);
+            refit(index);
+        }
+    }
+
+    /*
+     * Rotates the taller grandchild up when the children of a differ in height by more than one, returns the new subtree root
+     */
+    size_t balance(size_t a)
+    {
+        if (nodes[a].isLeaf() || nodes[a].height < 2) return a;
+
+        size_t b = nodes[a].left;
+        size_t c = nodes[a].right;
+        int difference = nodes[c].height - nodes[b].height;
+        if (difference > 1) return rotate(a,c,false);
+        if (difference < -1) return rotate(a,b,true);
+        return a;
+    }
+
+    // Moves up the child "up" of a, the other child stays below a on its side
+    size_t rotate(size_t a,size_t up,bool upIsLeft)
+    {
+        size_t f = nodes[up].left;
+        size_t g = nodes[up].right;
+
+        nodes[up].left = a;
+        nodes[up].parent = nodes[a].parent;
+        nodes[a].parent = up;
+        replaceChild(nodes[up].parent,a,up);
+
+        // The taller grandchild stays with up, the shorter one replaces up under a
+        size_t keep = nodes[f].height > nodes[g].height ? f : g;
+        size_t give = keep == f ? g : f;
+
+        nodes[up].right = keep;
+        if (upIsLeft) nodes[a].left = give;
+        else nodes[a].right = give;
+        nodes[give].parent = a;
+
+        refit(a);
+        refit(up);
+        return up;
+    }
+};
@@ -0,0 +1,162 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Clustered light assignment. The view frustum is split into a grid of clusters, screen space tiles times exponential
+ * depth slices, and every cluster keeps the list of point lights whose sphere of influence touches it. Lists are
+ * packed as an offset/count pair per cluster plus one flat index array, ready to be uploaded as buffer textures.
+ */
+namespace Clusters
+{
+    struct Grid
+    {
+        uint32_t x = 16,y = 9,z = 24;
+        float zNear = 0.1f,zFar = 500.0f;
+
+        inline uint32_t count() const { return x * y * z; }
+        inline uint32_t index(uint32_t i,uint32_t j,uint32_t k) const { return (k * y + j) * x + i; }
+
+        constexpr static float minNear = 1e-3f;
+
+        // Orthographic cameras can put the near plane at or behind the eye, the slices then start at minNear
+        inline float sliceNear() const { return std::max(zNear,minNear); }
+
+        // slice = log(depth) * scale + bias, slices grow with depth so near clusters stay small
+        inline float sliceScale() const { return z / std::log(zFar / sliceNear()); }
+        inline float sliceBias() const { return -std::log(sliceNear()) * sliceScale(); }
+        inline float sliceDepth(uint32_t k) const { return sliceNear() * std::pow(zFar / sliceNear(),float(k) / z); }
+    };
+
+    struct Assignment
+    {
+        Grid grid;
+        glm::mat4 projection = glm::mat4(0.0f);
+
+        std::vector<glm::vec3> clusterMin,clusterMax;       // View space bounds of every cluster
+        std::vector<uint32_t> ranges;                       // Offset and count of every cluster in indices
+        std::vector<uint32_t> indices;
+
+        std::vector<glm::vec4> viewLights;                  // View space center, radius
+        std::vector<std::vector<uint32_t>> sliceLights;     // Per slice scratch, candidates then assigned indexs
+        std::vector<std::vector<uint32_t>> sliceIndices;
+
+        /*
+         * Recomputes the cluster bounds, only needed when the projection changes. Tiles are bounded by the rays through
+         * their corners between the near and far plane, that works for perspective and orthographic projections alike
+         */
+        void buildBounds(const glm::mat4& _projection)
+        {
+            projection = _projection;
+            glm::mat4 inverseProjection = glm::inverse(projection);
+            auto unproject = [&](float x,float y,float z)
+            {
+                glm::vec4 p = inverseProjection * glm::vec4(x,y,z,1.0f);
+                return glm::vec3(p) / p.w;
+            };
+
+            grid.zNear = -unproject(0.0f,0.0f,-1.0f).z;
+            grid.zFar = -unproject(0.0f,0.0f,1.0f).z;
+
+            clusterMin.resize(grid.count());
+            clusterMax.resize(grid.count());
+            ranges.resize(grid.count() * 2);
+            sliceLights.resize(grid.z);
+            sliceIndices.resize(grid.z);
+
+            for (uint32_t j = 0; j < grid.y; j++)
+            for (uint32_t i = 0; i < grid.x; i++)
+            {
+                glm::vec3 nearCorner[4],farCorner[4];
+                for (int c = 0; c < 4; c++)
+                {
+                    float x = -1.0f + 2.0f * float(i + (c & 1)) / grid.x;
+                    float y = -1.0f + 2.0f * float(j + (c >> 1)) / grid.y;
+                    nearCorner[c] = unproject(x,y,-1.0f);
+                    farCorner[c] = unproject(x,y,1.0f);
+                }
+
+                for (uint32_t k = 0; k < grid.z; k++)
+                {
+                    glm::vec3 bmin(INFINITY),bmax(-INFINITY);
+                    for (uint32_t s = k; s <= k + 1; s++)
+                    {
+                        float depth = grid.sliceDepth(s);
+                        for (int c = 0; c < 4; c++)
+                        {
+                            float t = (depth + nearCorner[c].z) / (nearCorner[c].z - farCorner[c].z);
+                            glm::vec3 p = glm::mix(nearCorner[c],farCorner[c],t);
+                            bmin = glm::min(bmin,p);
+                            bmax = glm::max(bmax,p);
+                        }
+                    }
+                    clusterMin[grid.index(i,j,k)] = bmin;
+                    clusterMax[grid.index(i,j,k)] = bmax;
+                }
+            }
+        }
+
+        /*
+         * Assigns the lights (world space position, radius) to the clusters of a view, slices are processed in parallel
+         */
+        void assign(const glm::mat4& view,const std::vector<glm::vec3>& positions,const std::vector<float>& radius)
+        {
+            viewLights.resize(positions.size());
+            for (size_t l = 0; l < positions.size(); l++)
+                viewLights[l] = glm::vec4(glm::vec3(view * glm::vec4(positions[l],1.0f)),radius[l]);
+
+            #pragma omp parallel for schedule(dynamic)
+            for (uint32_t k = 0; k < grid.z; k++) assignSlice(k);
+
+            size_t total = 0;
+            for (uint32_t k = 0; k < grid.z; k++) total += sliceIndices[k].size();
+            indices.resize(total);
+
+            // Slices store offsets relative to their own list, rebase them into the shared index array
+            size_t offset = 0;
+            for (uint32_t k = 0; k < grid.z; k++)
+            {
+                std::copy(sliceIndices[k].begin(),sliceIndices[k].end(),indices.begin() + offset);
+                for (uint32_t c = grid.index(0,0,k); c < grid.index(0,0,k + 1); c++) ranges[c * 2] += offset;
+                offset += sliceIndices[k].size();
+            }
+        }
+
+        private:
+
+        inline static bool sphereTouchesBox(const glm::vec4& sphere,const glm::vec3& bmin,const glm::vec3& bmax)
+        {
+            glm::vec3 closest = glm::clamp(glm::vec3(sphere),bmin,bmax) - glm::vec3(sphere);
+            return glm::dot(closest,closest) <= sphere.w * sphere.w;
+        }
+
+        void assignSlice(uint32_t k)
+        {
+            std::vector<uint32_t>& candidates = sliceLights[k];
+            std::vector<uint32_t>& assigned = sliceIndices[k];
+            candidates.clear();
+            assigned.clear();
+
+            float sliceNear = grid.sliceDepth(k),sliceFar = grid.sliceDepth(k + 1);
+            for (uint32_t l = 0; l < viewLights.size(); l++)
+            {
+                float depth = -viewLights[l].z;
+                if (depth + viewLights[l].w >= sliceNear && depth - viewLights[l].w <= sliceFar) candidates.push_back(l);
+            }
+
+            for (uint32_t c = grid.index(0,0,k); c < grid.index(0,0,k + 1); c++)
+            {
+                ranges[c * 2] = assigned.size();
+                for (uint32_t l : candidates)
+                    if (sphereTouchesBox(viewLights[l],clusterMin[c],clusterMax[c])) assigned.push_back(l);
+                ranges[c * 2 + 1] = assigned.size() - ranges[c * 2];
+            }
+        }
+    };
+}
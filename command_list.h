@@ -0,0 +1,121 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * Render commands as a compact binary stream, a one byte opcode followed by its operands. Lists are recorded without
+ * touching GL, so worker threads can each record a slice of the frame, and the GL thread replays them in order.
+ */
+struct CommandList
+{
+    enum Opcode : uint8_t
+    {
+        USE_MATERIAL = 0,           // uint32 materialID
+        USE_MATERIAL_INSTANCE,      // uint32 materialInstanceID, applies to the current material
+        USE_MESH,                   // uint32 meshID
+        SET_RASTER,                 // uint8 cull back face, uint8 depth mask (draw without writing depth)
+        SET_OBJECT,                 // mat4 transform, mat3 normal matrix
+        DRAW,                       // Current mesh
+        DRAW_INSTANCED,             // uint32 first instance, uint32 count
+    };
+
+    std::vector<uint8_t> stream;
+
+    inline void clear() { stream.clear(); }
+    inline bool empty() const { return stream.empty(); }
+
+    template <typename... T>
+    inline void record(Opcode opcode,const T&... operands)
+    {
+        size_t at = stream.size();
+        stream.resize(at + 1 + (sizeof(T) + ... + 0));
+        stream[at++] = opcode;
+        ((std::memcpy(&stream[at],&operands,sizeof(T)), at += sizeof(T)), ...);
+    }
+
+    // Operands are packed, read them back in the order they were recorded
+    struct Reader
+    {
+        const uint8_t* at;
+        const uint8_t* end;
+
+        inline bool next(Opcode& opcode)
+        {
+            if (at == end) return false;
+            opcode = Opcode(*at++);
+            return true;
+        }
+
+        template <typename T>
+        inline T read()
+        {
+            T value;
+            std::memcpy(&value,at,sizeof(T));
+            at += sizeof(T);
+            return value;
+        }
+    };
+
+    inline Reader reader() const { return {stream.data(),stream.data() + stream.size()}; }
+};
+
+/*
+ * Records into a list skipping what is already current within it. The first change of every list is always recorded,
+ * the state left by the previous list is only known when replaying
+ */
+struct CommandRecorder
+{
+    const static uint32_t none = ~uint32_t(0);        // Also the instance of draws without one
+
+    CommandList& list;
+    uint32_t material = none,instance = none,mesh = none;
+    bool instanceKnown = false;
+    int raster = -1;
+
+    CommandRecorder(CommandList& _list) : list(_list) { }
+
+    inline void useMaterial(uint32_t materialID)
+    {
+        if (material == materialID) return;
+        material = materialID;
+        instanceKnown = false;
+        list.record(CommandList::USE_MATERIAL,materialID);
+    }
+
+    inline void useMaterialInstance(uint32_t materialInstanceID)
+    {
+        if (instanceKnown && instance == materialInstanceID) return;
+        instance = materialInstanceID;
+        instanceKnown = true;
+        list.record(CommandList::USE_MATERIAL_INSTANCE,materialInstanceID);
+    }
+
+    inline void useMesh(uint32_t meshID)
+    {
+        if (mesh == meshID) return;
+        mesh = meshID;
+        list.record(CommandList::USE_MESH,meshID);
+    }
+
+    inline void setRaster(bool cullBack,bool depthMask)
+    {
+        int packed = cullBack | depthMask << 1;
+        if (raster == packed) return;
+        raster = packed;
+        list.record(CommandList::SET_RASTER,uint8_t(cullBack),uint8_t(depthMask));
+    }
+
+    inline void setObject(const glm::mat4& transformMatrix,const glm::mat3& normalMatrix)
+    {
+        list.record(CommandList::SET_OBJECT,transformMatrix,normalMatrix);
+    }
+
+    inline void draw() { list.record(CommandList::DRAW); }
+
+    inline void drawInstanced(uint32_t firstInstance,uint32_t count)
+    {
+        list.record(CommandList::DRAW_INSTANCED,firstInstance,count);
+    }
+};
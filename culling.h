@@ -0,0 +1,129 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cmath>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+/*
+ * View frustum culling over bounding spheres stored as structure of arrays. The AVX path tests 8 spheres
+ * against all 6 planes at once, the debug build falls back to the scalar test.
+ */
+namespace Culling
+{
+    struct Frustum
+    {
+        glm::vec4 planes[6];        // xyz normal pointing inside, w distance
+    };
+
+    // Gribb-Hartmann plane extraction from a projection * view matrix
+    inline Frustum extractFrustum(const glm::mat4& viewProjection)
+    {
+        Frustum frustum;
+        glm::vec4 row[4];
+        for (int r = 0; r < 4; r++)
+            row[r] = glm::vec4(viewProjection[0][r],viewProjection[1][r],viewProjection[2][r],viewProjection[3][r]);
+
+        frustum.planes[0] = row[3] + row[0];
+        frustum.planes[1] = row[3] - row[0];
+        frustum.planes[2] = row[3] + row[1];
+        frustum.planes[3] = row[3] - row[1];
+        frustum.planes[4] = row[3] + row[2];
+        frustum.planes[5] = row[3] - row[2];
+
+        for (auto& plane : frustum.planes)
+            plane = plane * (1.0f / glm::length(glm::vec3(plane)));
+        return frustum;
+    }
+
+    struct SphereBatch
+    {
+        std::vector<float> x,y,z,radius;
+
+        inline size_t size() const { return x.size(); }
+
+        inline void clear()
+        {
+            x.clear(); y.clear(); z.clear(); radius.clear();
+        }
+
+        inline void push_back(const glm::vec3& center,float r)
+        {
+            x.push_back(center.x);
+            y.push_back(center.y);
+            z.push_back(center.z);
+            radius.push_back(r);
+        }
+    };
+
+    // World space sphere of a local sphere, the radius grows with the largest axis scale
+    inline void transformSphere(const glm::mat4& transform,const glm::vec4& localSphere,glm::vec3& center,float& radius)
+    {
+        center = glm::vec3(transform * glm::vec4(glm::vec3(localSphere),1.0f));
+        float scale = glm::max(glm::length(glm::vec3(transform[0])),glm::max(glm::length(glm::vec3(transform[1])),glm::length(glm::vec3(transform[2]))));
+        radius = localSphere.w * scale;
+    }
+
+    inline bool sphereVisible(const Frustum& frustum,float x,float y,float z,float radius)
+    {
+        for (const auto& plane : frustum.planes)
+            if (plane.x * x + plane.y * y + plane.z * z + plane.w < -radius) return false;
+        return true;
+    }
+
+    namespace Reference
+    {
+        inline void cull(const Frustum& frustum,const SphereBatch& spheres,std::vector<size_t>& visible)
+        {
+            visible.clear();
+            for (size_t i = 0; i < spheres.size(); i++)
+                if (sphereVisible(frustum,spheres.x[i],spheres.y[i],spheres.z[i],spheres.radius[i])) visible.push_back(i);
+        }
+    }
+
+#ifdef __AVX__
+    /*
+     * Appends the indexs of the visible spheres to visible, in order
+     */
+    inline void cull(const Frustum& frustum,const SphereBatch& spheres,std::vector<size_t>& visible)
+    {
+        visible.clear();
+        size_t count = spheres.size();
+        size_t batched = count & ~size_t(7);
+
+        __m256 px[6],py[6],pz[6],pw[6];
+        for (int p = 0; p < 6; p++)
+        {
+            px[p] = _mm256_set1_ps(frustum.planes[p].x);
+            py[p] = _mm256_set1_ps(frustum.planes[p].y);
+            pz[p] = _mm256_set1_ps(frustum.planes[p].z);
+            pw[p] = _mm256_set1_ps(frustum.planes[p].w);
+        }
+
+        for (size_t i = 0; i < batched; i += 8)
+        {
+            __m256 x = _mm256_loadu_ps(&spheres.x[i]);
+            __m256 y = _mm256_loadu_ps(&spheres.y[i]);
+            __m256 z = _mm256_loadu_ps(&spheres.z[i]);
+            __m256 negRadius = _mm256_sub_ps(_mm256_setzero_ps(),_mm256_loadu_ps(&spheres.radius[i]));
+
+            __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+            for (int p = 0; p < 6; p++)
+            {
+                __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px[p],x),_mm256_mul_ps(py[p],y)),
+                                         _mm256_add_ps(_mm256_mul_ps(pz[p],z),pw[p]));
+                inside = _mm256_and_ps(inside,_mm256_cmp_ps(d,negRadius,_CMP_GE_OQ));
+            }
+
+            for (int mask = _mm256_movemask_ps(inside); mask; mask &= mask - 1)
+                visible.push_back(i + __builtin_ctz(mask));
+        }
+
+        for (size_t i = batched; i < count; i++)
+            if (sphereVisible(frustum,spheres.x[i],spheres.y[i],spheres.z[i],spheres.radius[i])) visible.push_back(i);
+    }
+#else
+    using Reference::cull;
+#endif
+}
@@ -0,0 +1,203 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+
+/*
+ * Shadow copy of the GL state the renderer changes: program, vertex array, texture units, depth, culling, blending,
+ * color writes, viewport, uniform buffer ranges and sampler uniforms. Every change goes through here and calls that
+ * would set the value already current are dropped. Values start unknown so the first call always reaches GL, code
+ * that changes state behind the cache has to call invalidate() afterwards. Expects the GL declarations to be visible
+ * before the include.
+ */
+struct GLStateCache
+{
+    const static int maxTextureUnits = 16;
+    const static int maxUniformBindings = 8;
+    const static GLuint unknown = ~GLuint(0);
+
+    size_t calls = 0;           // GL calls issued
+    size_t skipped = 0;         // Redundant calls filtered out
+
+    GLStateCache() { invalidate(); }
+
+    void invalidate()
+    {
+        program = vertexArray = activeUnit = unknown;
+        for (int i = 0; i < maxTextureUnits; i++) textures[i] = textureTargets[i] = unknown;
+        depthTest = cullFace = blend = -1;
+        depthWrite = colorWrite = -1;
+        depthFunction = cullMode = blendSource = blendDestination = unknown;
+        for (int i = 0; i < 4; i++) viewportRect[i] = -1;
+        for (int i = 0; i < maxUniformBindings; i++) uniformRanges[i] = {unknown,-1,-1};
+        samplers.clear();
+    }
+
+    // All setters return true if they reached GL
+
+    inline bool useProgram(GLuint _program)
+    {
+        if (!changed(program,_program)) return false;
+        glUseProgram(program);
+        return true;
+    }
+
+    inline bool bindVertexArray(GLuint _vertexArray)
+    {
+        if (!changed(vertexArray,_vertexArray)) return false;
+        glBindVertexArray(vertexArray);
+        return true;
+    }
+
+    inline void activeTexture(GLuint unit)
+    {
+        if (changed(activeUnit,unit)) glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    // A unit keeps one binding per target, only the last one bound is tracked
+    inline bool bindTexture(GLuint unit,GLenum target,GLuint texture)
+    {
+        if (textures[unit] == texture && textureTargets[unit] == target)
+        {
+            skipped++;
+            return false;
+        }
+        activeTexture(unit);
+        glBindTexture(target,texture);
+        textures[unit] = texture;
+        textureTargets[unit] = target;
+        calls++;
+        return true;
+    }
+
+    // For creating and filling textures, binds on whatever unit is active
+    inline void bindTexture(GLenum target,GLuint texture)
+    {
+        if (activeUnit == unknown) activeTexture(0);
+        bindTexture(activeUnit,target,texture);
+    }
+
+    inline void setDepthTest(bool enabled) { toggle(depthTest,GL_DEPTH_TEST,enabled); }
+    inline void setCullFace(bool enabled) { toggle(cullFace,GL_CULL_FACE,enabled); }
+    inline void setBlend(bool enabled) { toggle(blend,GL_BLEND,enabled); }
+
+    inline void setDepthMask(bool enabled)
+    {
+        if (changed(depthWrite,int(enabled))) glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+    }
+
+    inline void setColorMask(bool enabled)
+    {
+        if (changed(colorWrite,int(enabled)))
+        {
+            GLboolean mask = enabled ? GL_TRUE : GL_FALSE;
+            glColorMask(mask,mask,mask,mask);
+        }
+    }
+
+    inline void setDepthFunc(GLenum function)
+    {
+        if (changed(depthFunction,function)) glDepthFunc(function);
+    }
+
+    inline void setCullMode(GLenum mode)
+    {
+        if (changed(cullMode,mode)) glCullFace(mode);
+    }
+
+    inline void setBlendFunc(GLenum source,GLenum destination)
+    {
+        if (blendSource == source && blendDestination == destination)
+        {
+            skipped++;
+            return;
+        }
+        blendSource = source;
+        blendDestination = destination;
+        glBlendFunc(source,destination);
+        calls++;
+    }
+
+    inline void setViewport(GLint x,GLint y,GLsizei width,GLsizei height)
+    {
+        GLint rect[4] = {x,y,width,height};
+        if (viewportRect[0] == x && viewportRect[1] == y && viewportRect[2] == width && viewportRect[3] == height)
+        {
+            skipped++;
+            return;
+        }
+        for (int i = 0; i < 4; i++) viewportRect[i] = rect[i];
+        glViewport(x,y,width,height);
+        calls++;
+    }
+
+    // Range of a buffer on a uniform block binding point, whole buffers bound with glBindBufferBase aren't tracked
+    inline bool bindUniformRange(GLuint index,GLuint buffer,GLintptr offset,GLsizeiptr size)
+    {
+        BufferRange& range = uniformRanges[index];
+        if (range.buffer == buffer && range.offset == offset && range.size == size)
+        {
+            skipped++;
+            return false;
+        }
+        range = {buffer,offset,size};
+        glBindBufferRange(GL_UNIFORM_BUFFER,index,buffer,offset,size);
+        calls++;
+        return true;
+    }
+
+    // Sampler uniform of the current program, values are remembered per program so switching back costs nothing
+    inline void setSampler(GLint location,GLint unit)
+    {
+        if (location == -1) return;
+        GLint& value = samplers.emplace((uint64_t(program) << 32) | uint32_t(location),-1).first->second;
+        if (value == unit)
+        {
+            skipped++;
+            return;
+        }
+        value = unit;
+        glUniform1i(location,unit);
+        calls++;
+    }
+
+    inline void resetCounters() { calls = skipped = 0; }
+
+    private:
+
+    struct BufferRange
+    {
+        GLuint buffer;
+        GLintptr offset;
+        GLsizeiptr size;
+    };
+
+    GLuint program,vertexArray,activeUnit;
+    GLuint textures[maxTextureUnits];
+    GLenum textureTargets[maxTextureUnits];
+    int depthTest,cullFace,blend,depthWrite,colorWrite;     // -1 unknown
+    GLenum depthFunction,cullMode,blendSource,blendDestination;
+    GLint viewportRect[4];
+    BufferRange uniformRanges[maxUniformBindings];
+    std::unordered_map<uint64_t,GLint> samplers;    // program << 32 | location -> unit
+
+    template <typename T>
+    inline bool changed(T& cached,T value)
+    {
+        if (cached == value)
+        {
+            skipped++;
+            return false;
+        }
+        cached = value;
+        calls++;
+        return true;
+    }
+
+    inline void toggle(int& cached,GLenum capability,bool enabled)
+    {
+        if (!changed(cached,int(enabled))) return;
+        if (enabled) glEnable(capability);
+        else glDisable(capability);
+    }
+};
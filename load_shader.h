@@ -6,7 +6,40 @@
 #include <fstream>
 #include <sstream>
 
-GLuint compileShader(const char * vertex_file_path,const char * fragment_file_path){
+// Replaces every #include "file" line with the file contents, paths are relative to the including shader
+std::string resolveIncludes(const std::string& code,const std::string& path){
+
+	std::string directory = path.substr(0,path.find_last_of('/') + 1);
+	std::stringstream in(code),out;
+	std::string line;
+	while(std::getline(in,line)){
+		if(line.compare(0,9,"#include ") == 0){
+			std::string file = line.substr(line.find('"') + 1);
+			file = file.substr(0,file.find('"'));
+			std::ifstream stream(directory + file, std::ios::in);
+			if(!stream.is_open()){
+				printf("Impossible to open %s included from %s\n", file.c_str(), path.c_str());
+				return code;
+			}
+			std::stringstream sstr;
+			sstr << stream.rdbuf();
+			out << resolveIncludes(sstr.str(),directory + file) << "\n";
+		}
+		else out << line << "\n";
+	}
+	return out.str();
+}
+
+// Inserts preprocessor definitions right after the #version line
+std::string insertDefines(const std::string& code,const std::string& defines){
+
+	if(defines.empty()) return code;
+	size_t version = code.find("#version");
+	size_t line = version == std::string::npos ? 0 : code.find('\n',version) + 1;
+	return code.substr(0,line) + defines + code.substr(line);
+}
+
+GLuint compileShader(const char * vertex_file_path,const char * fragment_file_path,const std::string& defines = ""){
 
 	// Create the shaders
 	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
@@ -18,7 +51,7 @@ GLuint compileShader(const char * vertex_file_path,const char * fragment_file_pa
 	if(VertexShaderStream.is_open()){
 		std::stringstream sstr;
 		sstr << VertexShaderStream.rdbuf();
-		VertexShaderCode = sstr.str();
+		VertexShaderCode = insertDefines(resolveIncludes(sstr.str(),vertex_file_path),defines);
 		VertexShaderStream.close();
 	}else{
 		printf("Impossible to open %s. Are you in the right directory ? Don't forget to read the FAQ !\n", vertex_file_path);
@@ -32,7 +65,7 @@ GLuint compileShader(const char * vertex_file_path,const char * fragment_file_pa
 	if(FragmentShaderStream.is_open()){
 		std::stringstream sstr;
 		sstr << FragmentShaderStream.rdbuf();
-		FragmentShaderCode = sstr.str();
+		FragmentShaderCode = insertDefines(resolveIncludes(sstr.str(),fragment_file_path),defines);
 		FragmentShaderStream.close();
 	}
 
@@ -7,6 +7,7 @@
 #include <map>
 #include <list>
 #include <map>
+#include <tuple>
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 #include <memory>
@@ -17,66 +18,46 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include "matrix_kernels.h"
+#include "transform.h"
 #include "spatial.h"
+#include "culling.h"
+#include "bvh.h"
+#include "clusters.h"
+#include "render_queue.h"
+#include "gl_state.h"
+#include "command_list.h"
+#include "uniform_tracking.h"
+#include "uniforms.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 using namespace glm;
 
 const float deltaTime = 0.1;
 
-
-/*
- * This templates keeps a sorted vector and a set of unordered references mapped to the vector
- * Bheaviour is the same as vector except that this structure enables for an ordered trasversal of the items
- */
-
-#define BATCHING_ENABLED
-template <typename T>
-struct sorted_vector
-{
-    vector<T> values;
-    vector<size_t> indexs;
-    map<T,size_t> batch;
-
-    sorted_vector() { }
-
-    size_t push_back(T value)
-    {
-        #ifdef BATCHING_ENABLED
-            auto it = lower_bound(values.begin(), values.end(),value);
-            size_t a = it - values.begin();
-            it = values.insert(it, value);
-
-            for (int i = a; i < indexs.size(); i++)
-            {
-                indexs[i]++;
-            }
-            indexs.push_back(a);
-            batch[value]++;
-            return indexs.size() - 1;
-
-        #else
-            values.push_back(value);
-            indexs.push_back(values.size() - 1);
-            return indexs.size() - 1;
-        #endif
-    }
-
-    const T& operator[] (size_t idx) const { return values[indexs[idx]]; }
-    T& operator[] (size_t idx) { return values[indexs[idx]]; }
-
-    inline bool size() { return indexs.size(); } 
-    vector<T>& native() {return values; }
-};
+GLStateCache glState;               // Every GL state change goes through here
 
 namespace Debug
 {
     int materialSwaps;
     int materialInstanceSwaps;
     int meshSwaps;
+    int drawCalls;
+    int instancedModels;
     int textureSwaps;
+    size_t totalTextureSwaps;           // Not reset, for the benchmark summary
     int uniformsFlush;
     int lightFlush;
+    int visibleModels;
+    int culledModels;
+    int clusterLightRefs;
+    int fenceWaits;
+    double fenceWaitMs;
+    int saturatedKeys;
+    size_t glCallsStart,glSkippedStart;
 
     int missingUniforms;
 
@@ -85,9 +66,19 @@ namespace Debug
         materialSwaps = 0;
         materialInstanceSwaps = 0;
         meshSwaps = 0;
+        drawCalls = 0;
+        instancedModels = 0;
         textureSwaps = 0;
         uniformsFlush = 0;
         lightFlush = 0;
+        visibleModels = 0;
+        culledModels = 0;
+        clusterLightRefs = 0;
+        fenceWaits = 0;
+        fenceWaitMs = 0.0;
+        saturatedKeys = 0;
+        glCallsStart = glState.calls;
+        glSkippedStart = glState.skipped;
     }
 
     inline void print()
@@ -98,7 +89,15 @@ namespace Debug
         cerr << "Uniform flushs: " << uniformsFlush << endl;
         cerr << "Light flush: " << lightFlush << endl;
         cerr << "Mesh swaps :" << meshSwaps << endl;
+        cerr << "Draw calls :" << drawCalls << endl;
+        cerr << "Instanced models :" << instancedModels << endl;
         cerr << "Texture swaps :" << textureSwaps << endl;
+        cerr << "Visible models :" << visibleModels << endl;
+        cerr << "Culled models :" << culledModels << endl;
+        cerr << "Cluster light references :" << clusterLightRefs << endl;
+        cerr << "Fence waits :" << fenceWaits << " (" << fenceWaitMs << " ms)" << endl;
+        cerr << "Saturated sort keys :" << saturatedKeys << endl;
+        cerr << "GL state calls :" << glState.calls - glCallsStart << " (" << glState.skipped - glSkippedStart << " skipped)" << endl;
         cerr << "----" << endl;
         cerr << "Missing uniforms: " << missingUniforms << endl;
         cerr << "----" << endl;
@@ -122,20 +121,30 @@ namespace Debug
     #define REGISTER_FRAME() Debug::reset()
     #define REGISTER_MATERIAL_SWAP() Debug::materialSwaps++
     #define REGISTER_MESH_SWAP() Debug::meshSwaps++
-    #define REGISTER_TEXTURE_SWAP() Debug::textureSwaps++
+    #define REGISTER_DRAW_CALL(instances) Debug::drawCalls++; if (instances > 1) Debug::instancedModels += instances
+    #define REGISTER_TEXTURE_SWAP() Debug::textureSwaps++; Debug::totalTextureSwaps++
     #define REGISTER_MATERIAL_INSTANCE_SWAP() Debug::materialInstanceSwaps++
     #define REGISTER_UNIFORM_FLUSH() Debug::uniformsFlush++
     #define REGISTER_LIGHT_FLUSH() Debug::lightFlush++
+    #define REGISTER_CULLING(visible,culled) Debug::visibleModels = visible; Debug::culledModels = culled
+    #define REGISTER_CLUSTER_ASSIGNMENT(refs) Debug::clusterLightRefs = refs
+    #define REGISTER_FENCE_WAIT(ms) Debug::fenceWaits++; Debug::fenceWaitMs += ms
+    #define REGISTER_SATURATED_KEY() Debug::saturatedKeys++
     #define LOG_FRAME() Debug::print()    
 #else
     #define REGISTER_MISSED_UNIFORM()
     #define REGISTER_FRAME()
     #define REGISTER_MATERIAL_SWAP()
     #define REGISTER_MESH_SWAP()
+    #define REGISTER_DRAW_CALL(instances)
     #define REGISTER_TEXTURE_SWAP()
     #define REGISTER_MATERIAL_INSTANCE_SWAP()
     #define REGISTER_UNIFORM_FLUSH()
     #define REGISTER_LIGHT_FLUSH()
+    #define REGISTER_CULLING(visible,culled)
+    #define REGISTER_CLUSTER_ASSIGNMENT(refs)
+    #define REGISTER_FENCE_WAIT(ms)
+    #define REGISTER_SATURATED_KEY()
     #define LOG_FRAME()
 #endif
 
@@ -164,7 +173,7 @@ namespace Viewport
     {
         screenWidth = width;
         screenHeight = height;
-        glViewport(0, 0, width, height);
+        glState.setViewport(0, 0, width, height);
     }
     
     void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
@@ -195,9 +204,31 @@ using TextureID = size_t;
 namespace Texture
 {
     const static size_t maxTextureUnits = 16;
-    vector<TextureData> texturesData;                                // textureID -> textureData
+
+    // Units reserved for scene wide textures
+    const static int lightDataUnit = 12;
+    const static int clusterRangesUnit = 13;
+    const static int clusterIndicesUnit = 14;
+    const static int objectDataUnit = 11;
+    vector<TextureData> texturesData;                                // Image textures, in load order
+    vector<TextureID> imageTextures;                                 // texturesData index -> textureID
     vector<GLuint> glTexturesIds;                                    // textureID -> GLID
-    vector<TextureID> texturesUnits(maxTextureUnits,-1);             // slot -> textureID
+
+    /*
+     * Optional packing of the image textures into GL_TEXTURE_2D_ARRAY, one array per size and format. Material
+     * instances then bind the arrays on their units, which consecutive instances mostly share, and only change the
+     * textureLayers uniform. Shaders read the first four units through materials/textures.glsl
+     */
+    struct TextureLayer
+    {
+        TextureID array;
+        GLint layer;
+    };
+
+    const static size_t maxArrayUnits = 4;
+    const static TextureID noArray = -1;
+    bool textureArrays = false;
+    vector<TextureLayer> textureLayers;                              // textureID -> array and layer, array noArray if not packed
 
     TextureID skyBoxID;
 
@@ -207,7 +238,7 @@ namespace Texture
 
         GLuint texId;
         glGenTextures(1,&texId);
-        glBindTexture(GL_TEXTURE_2D,texId);
+        glState.bindTexture(GL_TEXTURE_2D,texId);
 
         //Texture filtering
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	
@@ -221,7 +252,8 @@ namespace Texture
 
         texturesData.push_back(textureData);
         glTexturesIds.push_back(texId);
-        return texturesData.size() - 1;
+        imageTextures.push_back(glTexturesIds.size() - 1);
+        return glTexturesIds.size() - 1;
     }
     
     TextureID loadCubemap(const vector<TextureData> &cubemaps)
@@ -232,7 +264,7 @@ namespace Texture
 
         GLuint texId;
         glGenTextures(1, &texId);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, texId);
+        glState.bindTexture(GL_TEXTURE_CUBE_MAP, texId);
 
         glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -250,6 +282,64 @@ namespace Texture
         return glTexturesIds.size() - 1;
     }
 
+    /*
+     * Buffer texture over a buffer object, the buffer contents can be respecified later without touching the texture
+     */
+    TextureID loadBufferTexture(GLenum internalFormat,GLuint& buffer)
+    {
+        glGenBuffers(1,&buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER,buffer);
+        glBufferData(GL_TEXTURE_BUFFER,16,nullptr,GL_STREAM_DRAW);
+
+        GLuint texId;
+        glGenTextures(1,&texId);
+        glState.bindTexture(GL_TEXTURE_BUFFER,texId);
+        glTexBuffer(GL_TEXTURE_BUFFER,internalFormat,buffer);
+
+        glTexturesIds.push_back(texId);
+        return glTexturesIds.size() - 1;
+    }
+
+    void packTextureArrays()
+    {
+        map<tuple<int,int,int>,vector<size_t>> groups;                 // width, height, channels -> texturesData indexs
+        for (size_t i = 0; i < texturesData.size(); i++)
+            groups[make_tuple(texturesData[i].width,texturesData[i].height,texturesData[i].nrChannels)].push_back(i);
+
+        textureLayers.assign(glTexturesIds.size(),{noArray,0});
+        for (const auto& group : groups)
+        {
+            const TextureData& first = texturesData[group.second[0]];
+
+            GLuint texId;
+            glGenTextures(1,&texId);
+            glState.bindTexture(GL_TEXTURE_2D_ARRAY,texId);
+
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB, first.width, first.height, group.second.size(), 0, first.format(), GL_UNSIGNED_BYTE, nullptr);
+            for (size_t layer = 0; layer < group.second.size(); layer++)
+            {
+                const TextureData& textureData = texturesData[group.second[layer]];
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, textureData.width, textureData.height, 1, textureData.format(), GL_UNSIGNED_BYTE, textureData.data);
+            }
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+            glTexturesIds.push_back(texId);
+            for (size_t layer = 0; layer < group.second.size(); layer++)
+                textureLayers[imageTextures[group.second[layer]]] = {glTexturesIds.size() - 1,GLint(layer)};
+        }
+        cerr << "Packed " << texturesData.size() << " textures into " << groups.size() << " texture arrays" << endl;
+    }
+
+    inline bool isPacked(TextureID textureID)
+    {
+        return textureID < textureLayers.size() && textureLayers[textureID].array != noArray;
+    }
+
     TextureID createSkyBox(const vector<string>& paths)
     {
         vector<TextureData> textureData;
@@ -261,14 +351,7 @@ namespace Texture
     }
     inline void useTexture(TextureID textureID,int textureUnit,GLenum mode)
     {
-        GLuint glTextureID = glTexturesIds[textureID];
-        if (texturesUnits[textureUnit] != textureID)
-        {
-            texturesUnits[textureUnit] = textureID;
-            glActiveTexture(GL_TEXTURE0 + textureUnit);
-            glBindTexture(mode,glTextureID);
-            REGISTER_TEXTURE_SWAP();
-        }
+        if (glState.bindTexture(textureUnit,mode,glTexturesIds[textureID])) { REGISTER_TEXTURE_SWAP(); }
     }
     
     inline void setSkyBoxTexture(TextureID text_id)
@@ -284,85 +367,129 @@ namespace Texture
     
 }
 
-#define UNIFORMS_LIST(o) \
-    o(VEC2,glm::vec2) o(VEC3,glm::vec3) o(VEC4,glm::vec4) \
-    o(MAT2,glm::mat2) o(MAT3,glm::mat3) o(MAT4,glm::mat4) \
-    o(FLOAT,float) o(BOOL,bool) o(INT,int)
-
-enum UniformType
+/*
+ * Block layouts of the instances, one per list of uniform types, shared by every instance with the same types
+ */
+namespace UniformLayouts
 {
-    #define UNIFORMS_ENUMS_DECLARATION(v,T) v ,
-    UNIFORMS_LIST(UNIFORMS_ENUMS_DECLARATION)
-    #undef UNIFORMS_ENUMS_DECLARATION
-};
+    using LayoutID = uint32_t;
+    vector<UniformBlockLayout> layouts;
 
-using UniformID = size_t;
-class Uniform
-{
-    public:
-    union
+    LayoutID intern(const vector<UniformType>& types)
     {
-        #define UNIFORMS_UNION_DECLARATION(v,T) T v;
-        UNIFORMS_LIST(UNIFORMS_UNION_DECLARATION)
-        #undef UNIFORMS_UNION_DECLARATION
-    };
-
-    UniformType type;
-    bool forward;
-
-    Uniform() { }
-    #define UNIFORMS_CONSTRUCTOR(v,T) constexpr Uniform(const T& _##v) : v(_##v),type(UniformType::v),forward(true) { }
-    UNIFORMS_LIST(UNIFORMS_CONSTRUCTOR)
-    #undef UNIFORMS_CONSTRUCTOR
-};
+        for (LayoutID i = 0; i < layouts.size(); i++)
+            if (layouts[i].types == types) return i;
+        layouts.emplace_back(types);
+        return layouts.size() - 1;
+    }
+}
 
+/*
+ * Instance values are packed std140 in one block, the same bytes a MaterialBlock uniform block declaring the
+ * uniforms in slot order reads. Until it is loaded an instance owns its block, loaded instances keep it in
+ * sharedBlocks, every loaded block back to back without the alignment padding of the instance buffer
+ * (MaterialInstanceLoader), so they don't allocate on their own. Copies own their block again, moves keep where it is
+ */
 using MaterialInstanceID = size_t;
 struct MaterialInstance
 {
-    vector<Uniform> uniformValues;
-    vector<TextureID> assignedTextureUnits;
+    vector<uint8_t> block;                      // Empty once shared
+    vector<TextureID> assignedTextureUnits;     // Up to the last unit set
+    UniformLayouts::LayoutID layout;
+    uint32_t textureUnits = 0;          // Bit i set when unit i has a texture
+    uint32_t blockOffset = 0;           // Of the block in sharedBlocks
+    uint32_t bufferOffset = 0;          // Of the block in the instance buffer
+    bool shared = false;
+    InstanceChanges changes;
+
+    inline static vector<uint8_t> sharedBlocks;
+    inline static size_t totalChanges = 0;     // set() calls on every instance, the buffer is left alone while it stays
+    inline static size_t totalRepacks = 0;     // Shared blocks that changed size, the buffer is laid out again
+
+    MaterialInstance(const vector<Uniform>& values = {}) { pack(values); }
+
+    MaterialInstance(const MaterialInstance& other) { *this = other; }
+    MaterialInstance(MaterialInstance&&) noexcept = default;
+    MaterialInstance& operator=(MaterialInstance&&) noexcept = default;
+
+    MaterialInstance& operator=(const MaterialInstance& other)
+    {
+        if (this == &other) return *this;
+        block.assign(other.data(),other.data() + other.blockLayout().size);
+        assignedTextureUnits = other.assignedTextureUnits;
+        layout = other.layout;
+        textureUnits = other.textureUnits;
+        blockOffset = bufferOffset = 0;
+        shared = false;
+        changes = other.changes;
+        return *this;
+    }
 
-    MaterialInstance(size_t size = 0) : uniformValues(size), 
-    assignedTextureUnits(Texture::maxTextureUnits,-1) { }
+    inline const UniformBlockLayout& blockLayout() const { return UniformLayouts::layouts[layout]; }
+    inline uint64_t uniformSlots() const { return lowBits(blockLayout().types.size()); }
+    inline uint8_t* data() { return shared ? sharedBlocks.data() + blockOffset : block.data(); }
+    inline const uint8_t* data() const { return shared ? sharedBlocks.data() + blockOffset : block.data(); }
+    inline const uint8_t* value(UniformID id) const { return data() + blockLayout().offsets[id]; }
 
-    MaterialInstance(const vector<Uniform>& _uniformValues) : uniformValues(_uniformValues), 
-    assignedTextureUnits(Texture::maxTextureUnits,-1)
-    {}
+    // Packs into a block of its own, a shared instance gets its place in sharedBlocks back with the next upload
+    void pack(const vector<Uniform>& values)
+    {
+        vector<UniformType> types;
+        for (const Uniform& value : values) types.push_back(value.type);
+        layout = UniformLayouts::intern(types);
+
+        const UniformBlockLayout& packing = blockLayout();
+        block.assign(packing.size,0);
+        for (size_t i = 0; i < values.size(); i++) uniformPackers[types[i]](&block[packing.offsets[i]],values[i]);
+        if (shared) totalRepacks++;
+        shared = false;
+    }
 
-    inline void useUniform(UniformID id,GLuint glUniformID)
-    {
-        uniformValues[id].forward = false;
-        const Uniform& current = uniformValues[id];
-
-        switch(current.type)
-        {
-            case UniformType::VEC2:
-            glUniform2fv(glUniformID,1,&current.VEC2[0]); break;
-            case UniformType::VEC3:
-            glUniform3fv(glUniformID,1,&current.VEC3[0]); break;
-            case UniformType::VEC4:
-            glUniform4fv(glUniformID,1,&current.VEC4[0]); break;
-            case UniformType::MAT2:
-            glUniformMatrix2fv(glUniformID,1,false,&current.MAT2[0][0]); break;
-            case UniformType::MAT3:
-            glUniformMatrix3fv(glUniformID,1,false,&current.MAT3[0][0]); break;
-            case UniformType::MAT4:
-            glUniformMatrix4fv(glUniformID,1,false,&current.MAT4[0][0]); break;
-            case UniformType::FLOAT:
-            glUniform1f(glUniformID,current.FLOAT); break;
-            case UniformType::BOOL:
-            break;
-        }
-        REGISTER_UNIFORM_FLUSH();
+    // Moves the block to offset in blocks, the next sharedBlocks
+    inline void share(vector<uint8_t>& blocks,uint32_t offset)
+    {
+        std::copy(data(),data() + blockLayout().size,blocks.begin() + offset);
+        vector<uint8_t>().swap(block);
+        blockOffset = offset;
+        shared = true;
     }
-    #define UNIFORMS_FUNC_DECLARATION(v,T) \
-    inline void set(UniformID id,const T& a) { uniformValues[id].v = a; uniformValues[id].forward = true; uniformValues[id].type = UniformType::v; }
 
-    UNIFORMS_LIST(UNIFORMS_FUNC_DECLARATION)
-    #undef UNIFORMS_FUNC_DECLARATION
+    vector<Uniform> values() const
+    {
+        const UniformBlockLayout& packing = blockLayout();
+        vector<Uniform> values;
+        for (size_t i = 0; i < packing.types.size(); i++) values.push_back(uniformUnpackers[packing.types[i]](value(i)));
+        return values;
+    }
+
+    // Setting a slot to another type packs the block again
+    template <typename T>
+    inline void set(UniformID id,const T& value)
+    {
+        const UniformBlockLayout& packing = blockLayout();
+        if (packing.types[id] == uniformTypeOf<T>()) std140Write(data() + packing.offsets[id],value);
+        else
+        {
+            vector<Uniform> unpacked = values();
+            unpacked[id] = Uniform(value);
+            pack(unpacked);
+        }
+        changes.markUniform(id);
+        totalChanges++;
+    }
 
     inline void setTexture(TextureID textureID,int unitID) {
+        if (assignedTextureUnits.size() <= unitID) assignedTextureUnits.resize(unitID + 1,-1);
         assignedTextureUnits[unitID] = textureID;
+        textureUnits |= uint32_t(1) << unitID;
+        changes.markTextures();
+    }
+
+    // Bytes kept for the instance on the CPU, its part of sharedBlocks included
+    inline size_t memory() const
+    {
+        return sizeof(MaterialInstance) + block.capacity() + (shared ? blockLayout().size : 0) +
+               assignedTextureUnits.capacity() * sizeof(TextureID);
     }
 };
 
@@ -370,48 +497,174 @@ namespace MaterialInstanceLoader
 {
     vector<MaterialInstance> materialInstances;
 
+    /*
+     * Every instance block back to back in one uniform buffer, each starting at a multiple of the offset alignment,
+     * so switching instance binds another range of it. The buffer starts with a zeroed block read by draws without
+     * an instance. It is laid out again when instances were added or a shared block changed size, otherwise only
+     * the blocks of changed instances are written
+     */
+    GLuint instanceBuffer = 0;
+    GLint bufferAlignment = 256;
+    size_t bufferSize = 0;
+    size_t bufferInstances = 0;                 // Instances laid out in the buffer
+    size_t uploadedChanges = 0,uploadedRepacks = 0;
+    vector<uint32_t> uploadedVersions;
+    GLsizeiptr maxBlockSize = 0;                // Largest MaterialBlock of any material, size of the zeroed block and the padding
+
     MaterialInstanceID loadMaterialInstance(const MaterialInstance& materialInstance)
     {
         materialInstances.push_back(materialInstance);
         return materialInstances.size() - 1;
     }
+
+    inline size_t aligned(size_t offset) { return (offset + bufferAlignment - 1) / bufferAlignment * bufferAlignment; }
+
+    void layOut()
+    {
+        size_t blocksSize = 0;
+        bufferSize = aligned(maxBlockSize);
+        for (MaterialInstance& instance : materialInstances)
+        {
+            instance.bufferOffset = bufferSize;
+            bufferSize = aligned(bufferSize + instance.blockLayout().size);
+            blocksSize += instance.blockLayout().size;
+        }
+        bufferSize += maxBlockSize;
+
+        vector<uint8_t> blocks(blocksSize);
+        vector<uint8_t> staging(bufferSize,0);
+        size_t offset = 0;
+        for (MaterialInstance& instance : materialInstances)
+        {
+            instance.share(blocks,offset);
+            offset += instance.blockLayout().size;
+        }
+        MaterialInstance::sharedBlocks.swap(blocks);
+        for (const MaterialInstance& instance : materialInstances)
+            std::copy(instance.data(),instance.data() + instance.blockLayout().size,staging.begin() + instance.bufferOffset);
+        glBufferData(GL_UNIFORM_BUFFER,bufferSize,staging.data(),GL_DYNAMIC_DRAW);
+
+        bufferInstances = materialInstances.size();
+        uploadedVersions.resize(bufferInstances);
+        for (size_t i = 0; i < bufferInstances; i++) uploadedVersions[i] = materialInstances[i].changes.version;
+        REGISTER_UNIFORM_FLUSH();
+    }
+
+    void upload()
+    {
+        bool created = instanceBuffer == 0;
+        if (!created && bufferInstances == materialInstances.size() && uploadedChanges == MaterialInstance::totalChanges) return;
+        uploadedChanges = MaterialInstance::totalChanges;
+
+        if (created)
+        {
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT,&bufferAlignment);
+            glGenBuffers(1,&instanceBuffer);
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER,instanceBuffer);
+
+        if (created || bufferInstances != materialInstances.size() || uploadedRepacks != MaterialInstance::totalRepacks)
+        {
+            uploadedRepacks = MaterialInstance::totalRepacks;
+            return layOut();
+        }
+
+        for (size_t i = 0; i < bufferInstances; i++)
+        {
+            const MaterialInstance& instance = materialInstances[i];
+            if (uploadedVersions[i] == instance.changes.version) continue;
+            uploadedVersions[i] = instance.changes.version;
+            glBufferSubData(GL_UNIFORM_BUFFER,instance.bufferOffset,instance.blockLayout().size,instance.data());
+            REGISTER_UNIFORM_FLUSH();
+        }
+    }
+
+    // Bytes the instances take on the CPU
+    size_t memory()
+    {
+        size_t bytes = materialInstances.capacity() * sizeof(MaterialInstance) + MaterialInstance::sharedBlocks.capacity();
+        for (const MaterialInstance& instance : materialInstances)
+            bytes += instance.memory() - sizeof(MaterialInstance) - (instance.shared ? instance.blockLayout().size : 0);
+        return bytes;
+    }
 }
 
+/*
+ * Per object uniforms, everything shared by the whole frame lives in the SceneBlock uniform block instead
+ */
 enum UniformBasics
 {
-    UNIFORM_PROJECTION_MATRIX = 0,
-    UNIFORM_VIEW_MATRIX,
-    UNIFORM_TRANSFORM_MATRIX,
+    UNIFORM_TRANSFORM_MATRIX = 0,
     UNIFORM_NORMAL_MATRIX,
-    UNIFORM_TIME,
-    UNIFORM_LIGHTCOLOR,
-    UNIFORM_LIGHTPOSITION,
-    UNIFORM_LIGHTCOUNT,
-    UNIFORM_VIEW_POS,
     UNIFORM_SKYBOX,
+    UNIFORM_LIGHT_DATA,
+    UNIFORM_CLUSTER_RANGES,
+    UNIFORM_CLUSTER_INDICES,
+    UNIFORM_OBJECT_DATA,
+    UNIFORM_OBJECT_INDEX,
     UNIFORM_COUNT
 };
 
+const static GLuint sceneBlockBinding = 0;
+const static GLuint materialBlockBinding = 1;
+
 using MaterialID = size_t;
 struct Material
 {
-    const static int scene_uniform_count = UNIFORM_COUNT;
-    
+    /*
+     * Active uniform of the program as reflected at link time, size is the array length. Members of uniform blocks
+     * have location -1 and their block index and byte offset, the rest block -1
+     */
+    struct UniformInfo
+    {
+        string name;
+        GLenum type;
+        GLint size;
+        GLint location;
+        GLint block;
+        GLint offset;
+    };
+
+    struct UniformBlockInfo
+    {
+        string name;
+        GLuint index;
+        GLint dataSize;
+    };
+
     GLuint programID;
-    vector<GLuint> uniforms;
-    vector<MaterialInstanceID> usedInstances;
+    vector<GLuint> uniforms;                        // UniformBasics -> location, -1 if the program doesn't use it
+    vector<UniformInfo> layout;                     // Every active uniform, by name
+    vector<UniformBlockInfo> blocks;
+    vector<size_t> instanceUniforms;                // Instance slot -> layout index
+    vector<GLint> instanceLocations;                // Instance slot -> location, -1 in the MaterialBlock
+    vector<UniformType> instanceTypes;              // Instance slot -> type
+    vector<UniformUploader> uploaders;              // Instance slot -> upload routine of its type
+    uint64_t uniformSlots = 0;                      // Bit i set for every instance uniform outside the MaterialBlock
+    size_t blockSlots = 0;                          // The first ones, members of the MaterialBlock
+    GLsizeiptr materialBlockSize = 0;               // Range bound from the instance buffer, 0 without a MaterialBlock
+    BoundInstance boundInstance;                    // Instance and version of the last upload
     
     string materialName;
     vector<GLuint> textureUniforms;
+    GLint textureLayersUniform = -1;
+    MaterialInstanceID layersInstance = -1;         // Instance and version whose layers are in textureLayers
+    uint32_t layersVersion = 0;
     bool isSkyboxMaterial = false;
 
-    Material(string materialName,const list<string>& uniforms)
+    static string shaderDefines;            // Prepended to every shader, e.g. OBJECT_BUFFER
+
+    /*
+     * vertexVariant selects another vertex shader for the same fragment shader, e.g. "_instanced" loads
+     * materialName_instanced_vertex.glsl
+     */
+    Material(string materialName,const string& vertexVariant = "")
     {
         this->materialName = materialName;
         string fragmentPath = Directory::materialPrefix + materialName + "_fragment.glsl";
-        string vertexPath = Directory::materialPrefix + materialName + "_vertex.glsl";
+        string vertexPath = Directory::materialPrefix + materialName + vertexVariant + "_vertex.glsl";
     
-        programID = compileShader(vertexPath.c_str(),fragmentPath.c_str());
+        programID = compileShader(vertexPath.c_str(),fragmentPath.c_str(),shaderDefines);
         
         if (programID == -1)
         {
@@ -419,98 +672,295 @@ struct Material
             throw std::runtime_error("Error compiling shader");
         }
 
-        loadShaderUniforms(uniforms);
+        reflectUniforms();
+        loadShaderUniforms();
     }
 
-    inline GLuint getUniformLocation(GLuint programID,const char* name) const
+    inline static bool isSampler(GLenum type)
     {
-        GLuint location = glGetUniformLocation(programID,name);
-        if (location == -1)
+        switch (type)
         {
-            cerr << "Missing Uniform Location! " << programID << " " << materialName << " -> " << name << endl;
-            REGISTER_MISSED_UNIFORM();
+            case GL_SAMPLER_2D: case GL_SAMPLER_3D: case GL_SAMPLER_CUBE: case GL_SAMPLER_2D_ARRAY:
+            case GL_SAMPLER_BUFFER: case GL_INT_SAMPLER_BUFFER: case GL_UNSIGNED_INT_SAMPLER_BUFFER:
+            return true;
+        }
+        return false;
+    }
+
+    // Fills layout and blocks from the linked program
+    void reflectUniforms()
+    {
+        GLint count = 0,maxLength = 0;
+        glGetProgramiv(programID,GL_ACTIVE_UNIFORMS,&count);
+        glGetProgramiv(programID,GL_ACTIVE_UNIFORM_MAX_LENGTH,&maxLength);
+        vector<char> name(std::max(maxLength,1));
+        for (GLint i = 0; i < count; i++)
+        {
+            UniformInfo info;
+            GLsizei length = 0;
+            glGetActiveUniform(programID,i,name.size(),&length,&info.size,&info.type,&name[0]);
+            info.location = glGetUniformLocation(programID,&name[0]);
+            GLuint index = i;
+            glGetActiveUniformsiv(programID,1,&index,GL_UNIFORM_BLOCK_INDEX,&info.block);
+            glGetActiveUniformsiv(programID,1,&index,GL_UNIFORM_OFFSET,&info.offset);
+            info.name.assign(&name[0],length);
+            if (info.name.size() > 3 && info.name.compare(info.name.size() - 3,3,"[0]") == 0) info.name.resize(info.name.size() - 3);
+            layout.push_back(info);
+        }
+        std::sort(layout.begin(),layout.end(),[](const UniformInfo& a,const UniformInfo& b) { return a.name < b.name; });
+
+        glGetProgramiv(programID,GL_ACTIVE_UNIFORM_BLOCKS,&count);
+        glGetProgramiv(programID,GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH,&maxLength);
+        name.resize(std::max(maxLength,1));
+        for (GLint i = 0; i < count; i++)
+        {
+            UniformBlockInfo block;
+            GLsizei length = 0;
+            glGetActiveUniformBlockName(programID,i,name.size(),&length,&name[0]);
+            glGetActiveUniformBlockiv(programID,i,GL_UNIFORM_BLOCK_DATA_SIZE,&block.dataSize);
+            block.name.assign(&name[0],length);
+            block.index = i;
+            blocks.push_back(block);
         }
-        return location;
     }
-    void loadShaderUniforms(const list<string>& uniformsList)
+
+    /*
+     * Sorts the reflected uniforms into the engine ones, the texture samplers and the instance slots. Every uniform
+     * the engine doesn't set is an instance slot. The members of the MaterialBlock go first in declaration order and
+     * are read straight from the instance buffer, loose uniforms follow in name order and are uploaded one by one.
+     * Instance values are given in slot order
+     */
+    void loadShaderUniforms()
     { 
-        for(int i = 0; i < scene_uniform_count; i++)
-            uniforms.push_back(-1);
+        const static map<string,UniformBasics> basics = {
+            {"transformMatrix",UNIFORM_TRANSFORM_MATRIX},{"normalMatrix",UNIFORM_NORMAL_MATRIX},{"skybox",UNIFORM_SKYBOX},
+            {"lightData",UNIFORM_LIGHT_DATA},{"clusterRanges",UNIFORM_CLUSTER_RANGES},{"clusterIndices",UNIFORM_CLUSTER_INDICES},
+            {"objectData",UNIFORM_OBJECT_DATA},{"objectIndex",UNIFORM_OBJECT_INDEX}
+        };
+
+        for (const UniformBlockInfo& block : blocks)
+        {
+            if (block.name != "MaterialBlock") continue;
+            glUniformBlockBinding(programID,block.index,materialBlockBinding);
+            loadMaterialBlock(block);
+        }
+
+        uniforms.assign(UNIFORM_COUNT,-1);
+        for (size_t i = 0; i < layout.size(); i++)
+        {
+            const UniformInfo& info = layout[i];
+            if (info.location == -1) continue;
+
+            auto basic = basics.find(info.name);
+            if (basic != basics.end()) uniforms[basic->second] = info.location;
+            else if (info.name == "textureLayers") textureLayersUniform = info.location;
+            else if (isSampler(info.type))
+            {
+                size_t unit = info.name.compare(0,7,"texture") == 0 ? stoul("0" + info.name.substr(7)) : Texture::maxTextureUnits;
+                if (unit >= Texture::maxTextureUnits)
+                {
+                    cerr << "Unknown sampler! " << programID << " " << materialName << " -> " << info.name << endl;
+                    REGISTER_MISSED_UNIFORM();
+                    continue;
+                }
+                if (textureUniforms.size() <= unit) textureUniforms.resize(unit + 1,-1);
+                textureUniforms[unit] = info.location;
+            }
+            else if (uniformTypeOfGL(info.type) == UNIFORM_TYPE_COUNT || info.size != 1)
+            {
+                cerr << "Unsupported uniform type! " << programID << " " << materialName << " -> " << info.name << endl;
+                REGISTER_MISSED_UNIFORM();
+            }
+            else
+            {
+                instanceUniforms.push_back(i);
+                instanceLocations.push_back(info.location);
+                instanceTypes.push_back(uniformTypeOfGL(info.type));
+                uploaders.push_back(uniformUploaders[instanceTypes.back()]);
+            }
+        }
+        uniformSlots = lowBits(instanceLocations.size()) & ~lowBits(blockSlots);
+
+        bool sceneBlock = false;
+        for (const UniformBlockInfo& block : blocks)
+        {
+            if (block.name != "SceneBlock") continue;
+            glUniformBlockBinding(programID,block.index,sceneBlockBinding);
+            sceneBlock = true;
+        }
+        if (!sceneBlock)
+        {
+            cerr << "Missing SceneBlock! " << programID << " " << materialName << endl;
+            REGISTER_MISSED_UNIFORM();
+        }
 
-        uniforms[UNIFORM_PROJECTION_MATRIX] = getUniformLocation(programID,"projectionMatrix");
-        uniforms[UNIFORM_VIEW_MATRIX] = getUniformLocation(programID,"viewMatrix");
-        uniforms[UNIFORM_TRANSFORM_MATRIX] = getUniformLocation(programID,"transformMatrix");
-        uniforms[UNIFORM_NORMAL_MATRIX] = getUniformLocation(programID,"normalMatrix");
-        uniforms[UNIFORM_TIME] = getUniformLocation(programID,"time");
-        uniforms[UNIFORM_LIGHTCOLOR] = getUniformLocation(programID,"lightColor");
-        uniforms[UNIFORM_LIGHTPOSITION] = getUniformLocation(programID,"lightPosition");
-        uniforms[UNIFORM_LIGHTCOUNT] = getUniformLocation(programID,"lightCount");
-        uniforms[UNIFORM_VIEW_POS] = getUniformLocation(programID,"viewPos");
-        uniforms[UNIFORM_SKYBOX] = getUniformLocation(programID,"skybox");
+        // Samplers always read the same units, they are set once here. Sampler i reads unit i
+        glState.useProgram(programID);
+        glState.setSampler(uniforms[UNIFORM_OBJECT_DATA],Texture::objectDataUnit);
+        glState.setSampler(uniforms[UNIFORM_LIGHT_DATA],Texture::lightDataUnit);
+        glState.setSampler(uniforms[UNIFORM_CLUSTER_RANGES],Texture::clusterRangesUnit);
+        glState.setSampler(uniforms[UNIFORM_CLUSTER_INDICES],Texture::clusterIndicesUnit);
+        for (size_t i = 0; i < textureUniforms.size(); i++) glState.setSampler(textureUniforms[i],i);
+    }
 
-        for(const auto& uniform : uniformsList)
+    /*
+     * The members of the MaterialBlock become the first instance slots by offset. Their offsets have to be the
+     * std140 ones the instances pack with, a block with a member the instances can't hold or at another offset is
+     * rejected whole: no slots, nothing bound, its members keep the values the shader defaults them to
+     */
+    void loadMaterialBlock(const UniformBlockInfo& block)
+    {
+        for (size_t i = 0; i < layout.size(); i++)
         {
-            uniforms.emplace_back(getUniformLocation(programID,uniform.c_str()));
-            usedInstances.emplace_back();
-            //TODO: check uniform not found
+            if (layout[i].block == GLint(block.index)) instanceUniforms.push_back(i);
         }
+        std::sort(instanceUniforms.begin(),instanceUniforms.end(),[&](size_t a,size_t b) { return layout[a].offset < layout[b].offset; });
 
-        GLuint location = 0;
-        for (size_t i = 0; i < Texture::maxTextureUnits and location != -1; i++)
+        for (size_t i : instanceUniforms)
         {
-            string uniformName = "texture" + to_string(i);
-            location = glGetUniformLocation(programID,uniformName.c_str());
-            if(location != -1)
+            const UniformInfo& info = layout[i];
+            UniformType type = uniformTypeOfGL(info.type);
+            if (type == UNIFORM_TYPE_COUNT || info.size != 1)
             {
-                textureUniforms.push_back(location);
+                cerr << "Unsupported uniform type! " << programID << " " << materialName << " -> MaterialBlock." << info.name << endl;
+                return rejectMaterialBlock();
             }
+            instanceLocations.push_back(-1);
+            instanceTypes.push_back(type);
+            uploaders.push_back(nullptr);
         }
-        
+
+        UniformBlockLayout packing(instanceTypes);
+        for (size_t i = 0; i < instanceUniforms.size(); i++)
+        {
+            if (GLuint(layout[instanceUniforms[i]].offset) == packing.offsets[i]) continue;
+            cerr << "MaterialBlock isn't std140! " << programID << " " << materialName << " -> " << layout[instanceUniforms[i]].name << endl;
+            return rejectMaterialBlock();
+        }
+
+        blockSlots = instanceUniforms.size();
+        materialBlockSize = block.dataSize;
+        MaterialInstanceLoader::maxBlockSize = std::max(MaterialInstanceLoader::maxBlockSize,materialBlockSize);
+    }
+
+    void rejectMaterialBlock()
+    {
+        REGISTER_MISSED_UNIFORM();
+        instanceUniforms.clear();
+        instanceLocations.clear();
+        instanceTypes.clear();
+        uploaders.clear();
+    }
+
+    // Instance slot of a uniform, -1 if the material has none by that name
+    inline UniformID slot(const string& name) const
+    {
+        for (UniformID i = 0; i < instanceUniforms.size(); i++)
+            if (layout[instanceUniforms[i]].name == name) return i;
+        return -1;
+    }
+
+    // An instance with one value per slot, each typed as its uniform and zeroed
+    MaterialInstance makeInstance() const
+    {
+        vector<Uniform> values;
+        for (UniformType type : instanceTypes) values.push_back(uniformZeros[type]());
+        return MaterialInstance(values);
     }
 
     inline void bind()
     {
-        glUseProgram(programID);
+        glState.useProgram(programID);
+        boundInstance.texturesBound = false;
         if (uniforms[UNIFORM_SKYBOX] != -1)
         {
-            glUniform1i(uniforms[UNIFORM_SKYBOX],Texture::bindSkyBox());
+            glState.setSampler(uniforms[UNIFORM_SKYBOX],Texture::bindSkyBox());
         }
     }
 
+    /*
+     * The MaterialBlock switches with one range binding, the binding point is shared by every program so it is
+     * checked on every call, without an instance it reads the zeroed block. Loose uniforms upload only what the
+     * program hasn't seen of the instance, see BoundInstance. Textures are bound again after the program was, other
+     * materials may have used the units in between
+     */
     void useInstance(MaterialInstanceID materialInstanceID)
     {
-        bool swap = false;
+        if (materialInstanceID == -1)
+        {
+            if (materialBlockSize != 0) glState.bindUniformRange(materialBlockBinding,MaterialInstanceLoader::instanceBuffer,0,materialBlockSize);
+            return;
+        }
+
         const MaterialInstance& instance = MaterialInstanceLoader::materialInstances[materialInstanceID];
 
-        // Set all uniforms
-        for (UniformID i = 0; i < usedInstances.size(); i++)
+        bool swapped = materialBlockSize != 0 &&
+            glState.bindUniformRange(materialBlockBinding,MaterialInstanceLoader::instanceBuffer,instance.bufferOffset,materialBlockSize);
+
+        uint64_t uniformBits;
+        uint32_t textureBits;
+        if (!boundInstance.update(materialInstanceID,instance.changes,uniformSlots & instance.uniformSlots(),instance.textureUnits,uniformBits,textureBits))
         {
-            if (usedInstances[i] != materialInstanceID || instance.uniformValues[i].forward)
-            {
-                usedInstances[i] = materialInstanceID;
-                MaterialInstanceLoader::materialInstances[materialInstanceID].useUniform(i,uniforms[i + scene_uniform_count]);
-                swap = true;
-            }
+            if (swapped) REGISTER_MATERIAL_INSTANCE_SWAP();
+            return;
         }
 
-        for (size_t i = 0; i < instance.assignedTextureUnits.size(); i++)
+        const UniformBlockLayout& packing = instance.blockLayout();
+        forEachBit(uniformBits,[&](size_t i)
         {
-            if (instance.assignedTextureUnits[i] != -1)
+            #ifdef DEBUG
+            if (packing.types[i] != instanceTypes[i])
             {
-                Texture::useTexture(instance.assignedTextureUnits[i],i,isSkyboxMaterial ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D);
-                glUniform1i(textureUniforms[i],i);
+                REGISTER_MISSED_UNIFORM();
+                return;
             }
+            #endif
+            uploaders[i](instanceLocations[i],instance.value(i));
+            REGISTER_UNIFORM_FLUSH();
+        });
+        if (swapped || uniformBits) REGISTER_MATERIAL_INSTANCE_SWAP();
+
+        if (textureLayersUniform != -1) useTextureLayers(materialInstanceID);
+        else forEachBit(textureBits,[&](size_t i)
+        {
+            Texture::useTexture(instance.assignedTextureUnits[i],i,isSkyboxMaterial ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D);
+        });
+    }
+
+    /*
+     * Packed textures: the arrays go on the units, the layers into one uniform that only changes with the instance or
+     * its version
+     */
+    void useTextureLayers(MaterialInstanceID materialInstanceID)
+    {
+        const MaterialInstance& instance = MaterialInstanceLoader::materialInstances[materialInstanceID];
+
+        GLint layers[Texture::maxArrayUnits] = {0};
+        for (size_t i = 0; i < Texture::maxArrayUnits && i < textureUniforms.size() && i < instance.assignedTextureUnits.size(); i++)
+        {
+            TextureID textureID = instance.assignedTextureUnits[i];
+            if (!Texture::isPacked(textureID)) continue;
+
+            Texture::useTexture(Texture::textureLayers[textureID].array,i,GL_TEXTURE_2D_ARRAY);
+            layers[i] = Texture::textureLayers[textureID].layer;
+        }
+
+        if (layersInstance != materialInstanceID || layersVersion != instance.changes.version)
+        {
+            layersInstance = materialInstanceID;
+            layersVersion = instance.changes.version;
+            glUniform4iv(textureLayersUniform,1,layers);
         }
-        
-        if (swap) REGISTER_MATERIAL_INSTANCE_SWAP();
     }
 
-    inline bool isLightSensitive() const
+    inline bool isClustered() const
     {
-        return uniforms[UNIFORM_LIGHTPOSITION] != -1;
+        return uniforms[UNIFORM_LIGHT_DATA] != -1;
     }
 };
 
+string Material::shaderDefines;
+
 /** 
  * Mantiene todos los shaders cargados i crea la abstracción de Material
  */
@@ -518,20 +968,34 @@ namespace MaterialLoader
 {
     MaterialID debugMaterialID = -1;
     MaterialInstanceID debugMaterialInstanceID = -1;
+    MaterialID clusteredMaterialID = -1;
+    MaterialID overdrawMaterialID = -1;                 // The debug material, counting shaded fragments
+    MaterialInstanceID overdrawMaterialInstanceID = -1;
+    MaterialID depthMaterialID = -1;                    // Position only, for the depth pre-pass
     
     vector<Material> materials;
-    vector<size_t> usedMaterials;
+    vector<MaterialID> instancedVariants;        // materialID -> material reading its transforms per instance, or -1
 
     MaterialID currentMaterial = -1;
     
     MaterialID loadMaterial(const Material& material)
     {
         materials.push_back(material);
-        usedMaterials.push_back(0);
+        instancedVariants.push_back(-1);
         MaterialID mat = materials.size() - 1;
         return mat;
     }
 
+    /*
+     * The variant has to declare the same uniforms as the base material so its instances can be used on both
+     */
+    inline MaterialID loadInstancedVariant(MaterialID base,const Material& variant)
+    {
+        MaterialID variantID = loadMaterial(variant);
+        instancedVariants[base] = variantID;
+        return variantID;
+    }
+
     const inline vector<GLuint>& current()
     {
         return materials[currentMaterial].uniforms;
@@ -621,19 +1085,6 @@ struct Camera
         invViewMatrix = glm::inverse(viewMatrix);
     
     }
-
-    void flush()
-    {
-            glUniformMatrix4fv(MaterialLoader::current()[UNIFORM_PROJECTION_MATRIX],1,false,&projectionMatrix[0][0]);
-            glUniform3fv(MaterialLoader::current()[UNIFORM_VIEW_POS],1,&invViewMatrix[3][0]);
-            
-            if(MaterialLoader::materials[MaterialLoader::currentMaterial].isSkyboxMaterial)
-            {
-                mat4 skyView = mat4(mat3(viewMatrix));
-                glUniformMatrix4fv(MaterialLoader::current()[UNIFORM_VIEW_MATRIX],1,false,&skyView[0][0]);
-            }else
-            glUniformMatrix4fv(MaterialLoader::current()[UNIFORM_VIEW_MATRIX],1,false,&viewMatrix[0][0]);
-    }
 };
 
 using CameraID = size_t;
@@ -660,12 +1111,6 @@ namespace Scene {
     {
         CameraLoader::cameras[currentCamera].update();
     }
-
-    void flush()
-    {
-        CameraLoader::cameras[currentCamera].flush();
-        glUniform1f(       MaterialLoader::current()[UNIFORM_TIME],time);
-    }
 };
 
 enum MeshRegionType
@@ -826,11 +1271,36 @@ struct Mesh {
     size_t vertexStride;
     shared_ptr<MeshBuffer> meshBuffer;
 
+    glm::vec3 boundsMin,boundsMax;      // Local space bounds, computed once at load
+    glm::vec4 boundingSphere;           // xyz center, w radius
+
     Mesh(const GLfloat* raw_meshBuffer,int _vertexCount,int _vertexStride) : vertexCount(_vertexCount), vertexStride(_vertexStride),
-    meshBuffer(new MeshBuffer(raw_meshBuffer,_vertexCount,_vertexStride)) { }
+    meshBuffer(new MeshBuffer(raw_meshBuffer,_vertexCount,_vertexStride)) 
+    { 
+        computeBounds();
+    }
 
     inline const GLfloat* meshPtr() const { return (const GLfloat*)&meshBuffer->meshBuffer[0]; }
 
+    void computeBounds()
+    {
+        boundsMin = vec3(INFINITY);
+        boundsMax = vec3(-INFINITY);
+        for (size_t i = 0; i < vertexCount; i++)
+        {
+            const vec3 v = *(const vec3*)&meshPtr()[i * vertexStride];
+            boundsMin = glm::min(boundsMin,v);
+            boundsMax = glm::max(boundsMax,v);
+        }
+
+        vec3 center = (boundsMin + boundsMax) * 0.5f;
+        float radius = 0.0f;
+        for (size_t i = 0; i < vertexCount; i++)
+            radius = glm::max(radius,glm::length(*(const vec3*)&meshPtr()[i * vertexStride] - center));
+
+        boundingSphere = vec4(center,radius);
+    }
+
 };
 
 struct Vertex
@@ -857,7 +1327,7 @@ struct PreparedMesh
         glGenBuffers(1, &VBO);
         glGenBuffers(1, &EBO);
 
-        glBindVertexArray(VAO);
+        glState.bindVertexArray(VAO);
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
 
         glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);  
@@ -875,7 +1345,7 @@ struct PreparedMesh
         glEnableVertexAttribArray(2);	
         glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texCoords));
 
-        glBindVertexArray(0);
+        glState.bindVertexArray(0);
     }
 };
 
@@ -944,6 +1414,73 @@ namespace MeshLoader
         return meshes.size() - 1;
     }
 
+    // Releases the GL objects and vertices of a mesh no model uses anymore, the MeshID stays taken and draws nothing
+    void freeMesh(MeshID meshID)
+    {
+        Mesh& mesh = meshes[meshID];
+        glDeleteVertexArrays(1,&mesh.vao);
+        glDeleteBuffers(1,&mesh.vbo);
+        glState.invalidate();               // Deleting the bound vertex array unbinds it behind the cache
+        mesh.vao = mesh.vbo = 0;
+        mesh.vertexCount = 0;
+        mesh.meshBuffer.reset();
+        if (currentMesh == meshID) currentMesh = -1;
+    }
+
+    /*
+     * Every mesh interleaved in one vertex buffer (position, color, uv, normal, tangent) behind one VAO, so a single
+     * indirect draw can reach any of them through its first vertex. Rebuilt whenever meshes were loaded since last time
+     */
+    const static size_t poolStride = 14;
+    const static MeshID poolMeshID = -2;        // currentMesh while drawing from the pool
+    GLuint poolVAO = 0,poolVBO;
+    size_t poolMeshCount = 0;
+    vector<GLint> poolFirstVertex;              // meshID -> first vertex in the pool
+
+    void buildPool()
+    {
+        if (poolMeshCount == meshes.size()) return;
+
+        vector<GLfloat> pool;
+        poolFirstVertex.clear();
+        for (const Mesh& mesh : meshes)
+        {
+            poolFirstVertex.push_back(pool.size() / poolStride);
+            if (!mesh.meshBuffer) continue;         // Freed
+
+            const MeshBuffer& buffer = *mesh.meshBuffer;
+            const MeshRegion& normals = buffer.regions[REGION_NORMAL];
+            const MeshRegion& tangents = buffer.regions[REGION_TANGENT];
+
+            for (size_t v = 0; v < mesh.vertexCount; v++)
+            {
+                const GLfloat* row = &buffer.meshBuffer[v * mesh.vertexStride];
+                GLfloat vertex[poolStride] = {0};
+                copy(row,row + std::min<size_t>(mesh.vertexStride,8),vertex);
+                if (normals.enabled()) copy(&buffer.meshBuffer[normals.offset + v * 3],&buffer.meshBuffer[normals.offset + v * 3] + 3,vertex + 8);
+                if (tangents.enabled()) copy(&buffer.meshBuffer[tangents.offset + v * 3],&buffer.meshBuffer[tangents.offset + v * 3] + 3,vertex + 11);
+                pool.insert(pool.end(),vertex,vertex + poolStride);
+            }
+        }
+
+        if (poolVAO == 0)
+        {
+            glGenVertexArrays(1,&poolVAO);
+            glGenBuffers(1,&poolVBO);
+        }
+        glState.bindVertexArray(poolVAO);
+        glBindBuffer(GL_ARRAY_BUFFER,poolVBO);
+        glBufferData(GL_ARRAY_BUFFER,pool.size() * sizeof(GLfloat),&pool[0],GL_STATIC_DRAW);
+
+        const GLint sizes[] = {3,3,2,3,3};
+        for (GLuint i = 0,offset = 0; i < 5; offset += sizes[i++])
+        {
+            glVertexAttribPointer(i,sizes[i],GL_FLOAT,GL_FALSE,poolStride * sizeof(GLfloat),(void*)(offset * sizeof(GLfloat)));
+            glEnableVertexAttribArray(i);
+        }
+        poolMeshCount = meshes.size();
+    }
+
     static const GLfloat triangle_mesh[] = {
        -1.0f, -1.0f, 0.0f, 1.0,0.0,0.0,
        1.0f, -1.0f, 0.0f,  0.0,1.0,0.0,
@@ -1075,7 +1612,7 @@ namespace MeshLoader
     {
         GLuint VAO,VBO;
         glGenVertexArrays(1, &VAO);
-        glBindVertexArray(VAO);
+        glState.bindVertexArray(VAO);
     
         glGenBuffers(1, &VBO);
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
@@ -1124,6 +1661,32 @@ namespace MeshLoader
         }
         return mesh;
     }
+
+    /*
+     * Mesh from vertices already in world space, rows of position, color and uv plus one normal and tangent per vertex
+     */
+    Mesh createBakedMesh(const vector<GLfloat>& rows,const vector<vec3>& normals,const vector<vec3>& tangents)
+    {
+        size_t vertexCount = normals.size();
+        Mesh mesh(&rows[0],vertexCount,8);
+        MeshBuffer& buffer = *mesh.meshBuffer;
+
+        size_t normalsPointer = buffer.allocateRegion();
+        memcpy(&buffer.meshBuffer[normalsPointer],&normals[0],vertexCount * sizeof(vec3));
+        buffer.regions[REGION_NORMAL] = {normalsPointer,3,3};
+
+        size_t tangentsPointer = buffer.allocateRegion();
+        memcpy(&buffer.meshBuffer[tangentsPointer],&tangents[0],vertexCount * sizeof(vec3));
+        buffer.regions[REGION_TANGENT] = {tangentsPointer,3,3};
+
+        glGenVertexArrays(1,&mesh.vao);
+        glState.bindVertexArray(mesh.vao);
+        glGenBuffers(1,&mesh.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER,mesh.vbo);
+        buffer.bufferData();
+        buffer.bindRegions();
+        return mesh;
+    }
 };
 
 namespace Renderer
@@ -1133,36 +1696,83 @@ namespace Renderer
     inline void useMaterialInstance(MaterialInstanceID id);
     inline void useMesh(MeshID id);
     inline void drawMesh();
+    inline void drawMeshInstanced(size_t firstInstance,size_t count);
+    inline void drawMeshIndirect(size_t firstCommand,size_t count);
+    inline void useObject(const mat4& transformMatrix,const mat3& normalMatrix);
+    inline void setRaster(bool cullBack,bool depthMask);
 }
 using LightID = size_t;
 
+/*
+ * Point lights. Materials reading the light arrays of the SceneBlock only see the first maxLights, clustered materials
+ * read every light through buffer textures and only loop over the lights assigned to the cluster of each fragment
+ */
 namespace Light
 {
     const static size_t maxLights = 6;
-    bool flushUniforms = true;
 
     vector<glm::vec3> lightsPositions;
     vector<glm::vec3> lightsColor;
+    vector<float> lightsRadius;
+
+    Clusters::Assignment clusters;
+    bool lightDataDirty = true;
+    vector<glm::vec4> lightData;                // position radius, color
+
+    GLuint lightDataBuffer,clusterRangesBuffer,clusterIndicesBuffer;
+    TextureID lightDataTexture = -1,clusterRangesTexture,clusterIndicesTexture;
 
-    inline LightID load(glm::vec3 pos,glm::vec3 color)
+    inline LightID load(glm::vec3 pos,glm::vec3 color,float radius = 10.0f)
     {
         lightsPositions.push_back(pos);
         lightsColor.push_back(color);
-        flushUniforms = true;
+        lightsRadius.push_back(radius);
+        lightDataDirty = true;
         return lightsPositions.size() - 1;
     }
 
-    inline void flush()
+    template <typename T>
+    inline void uploadBuffer(GLuint buffer,const vector<T>& data)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER,buffer);
+        glBufferData(GL_TEXTURE_BUFFER,data.size() * sizeof(T),data.empty() ? nullptr : &data[0],GL_STREAM_DRAW);
+    }
+
+    /*
+     * Rebuilds the cluster light lists for the current camera and uploads them, called once per frame
+     */
+    void updateClusters(const Camera& camera)
     {
-        Material& mat = MaterialLoader::materials[MaterialLoader::currentMaterial];
-        if (flushUniforms && mat.isLightSensitive())
+        if (lightDataTexture == -1)
         {
-            glUniform3fv(mat.uniforms[UNIFORM_LIGHTPOSITION],lightsPositions.size(),(GLfloat*)&lightsPositions[0]);
-            glUniform3fv(mat.uniforms[UNIFORM_LIGHTCOLOR],lightsColor.size(),(GLfloat*)&lightsColor[0]);
-            glUniform1i(mat.uniforms[UNIFORM_LIGHTCOUNT],lightsColor.size());
-            
+            lightDataTexture = Texture::loadBufferTexture(GL_RGBA32F,lightDataBuffer);
+            clusterRangesTexture = Texture::loadBufferTexture(GL_RG32UI,clusterRangesBuffer);
+            clusterIndicesTexture = Texture::loadBufferTexture(GL_R32UI,clusterIndicesBuffer);
+        }
+
+        if (lightDataDirty)
+        {
+            lightData.clear();
+            for (size_t i = 0; i < lightsPositions.size(); i++)
+            {
+                lightData.push_back(vec4(lightsPositions[i],lightsRadius[i]));
+                lightData.push_back(vec4(lightsColor[i],0.0f));
+            }
+            uploadBuffer(lightDataBuffer,lightData);
+            lightDataDirty = false;
             REGISTER_LIGHT_FLUSH();
         }
+
+        if (camera.projectionMatrix != clusters.projection) clusters.buildBounds(camera.projectionMatrix);
+        clusters.assign(camera.viewMatrix,lightsPositions,lightsRadius);
+
+        uploadBuffer(clusterRangesBuffer,clusters.ranges);
+        uploadBuffer(clusterIndicesBuffer,clusters.indices);
+        REGISTER_CLUSTER_ASSIGNMENT(clusters.indices.size());
+
+        Texture::useTexture(lightDataTexture,Texture::lightDataUnit,GL_TEXTURE_BUFFER);
+        Texture::useTexture(clusterRangesTexture,Texture::clusterRangesUnit,GL_TEXTURE_BUFFER);
+        Texture::useTexture(clusterIndicesTexture,Texture::clusterIndicesUnit,GL_TEXTURE_BUFFER);
     }
 };
 
@@ -1173,84 +1783,270 @@ struct Model
     MeshID meshID;
     MaterialID materialID;
     MaterialInstanceID materialInstanceID = -1;
+    size_t proxy = -1;              // Leaf in ModelLoader::tree
+    AABB bounds;                    // World bounds as of the last refit
 
     mat4 transformMatrix;
     mat3 normalMatrix;
 
-    bool depthMask = false;
-    bool cullBack = false;
+    Transform transform;            // Only used when decomposed, transformMatrix is then derived from it
+    bool decomposed = false;
 
-    static bool lastCull;
+    bool depthMask = false;         // Drawn without writing depth, like the skybox
+    bool cullBack = false;
+    bool isStatic = false;          // Never moves after load, ModelLoader::bakeStatic can merge it
+    bool baked = false;             // A chunk made by ModelLoader::bakeStatic, static but never merged again
 
     Model(MeshID _meshID,MaterialID _materialID = 0) : meshID(_meshID), materialID(_materialID), transformMatrix(1.0f) { }
 
-    inline void draw()
+    inline AABB worldBounds() const
     {
+        const Mesh& mesh = MeshLoader::meshes[meshID];
+        return AABB::transform(transformMatrix,mesh.boundsMin,mesh.boundsMax);
+    }
 
-        if (lastCull != cullBack)
-        {
-            glCullFace(GL_FRONT + cullBack);
-            lastCull = cullBack;
-        }  
+    inline void setTransform(const Transform& _transform)
+    {
+        transform = _transform;
+        decomposed = true;
+        transformMatrix = transform.getMatrix();
+    }
 
-        if (depthMask) glDepthMask(GL_FALSE);
+    inline void useState() const
+    {
+        Renderer::setRaster(cullBack,depthMask);
+    }
+
+    inline void draw()
+    {
+        useState();
 
         Renderer::useMaterial(materialID);
-        if (materialInstanceID != -1) Renderer::useMaterialInstance(materialInstanceID);
+        Renderer::useMaterialInstance(materialInstanceID);
 
         Renderer::useMesh(meshID);
-        
-        const vector<GLuint>& uniformVector = MaterialLoader::current();
-        
-        if(uniformVector[UNIFORM_TRANSFORM_MATRIX] != -1)
-        {
-            glUniformMatrix4fv(uniformVector[UNIFORM_TRANSFORM_MATRIX],1,false,&transformMatrix[0][0]);
-        }
+        Renderer::useObject(transformMatrix,normalMatrix);
+        Renderer::drawMesh();
+    }
 
-        if (uniformVector[UNIFORM_NORMAL_MATRIX] != -1)
-        {
-            normalMatrix = glm::transpose(glm::inverse(transformMatrix));
-            glUniformMatrix3fv(uniformVector[UNIFORM_NORMAL_MATRIX],1,false,&normalMatrix[0][0]);
-        }
+    /*
+     * Draws count commands of the indirect buffer with the instanced variant of the material, every command reads its
+     * transform from the per draw buffer through its base instance
+     */
+    inline void drawIndirect(size_t firstCommand,size_t count)
+    {
+        useState();
 
-        Renderer::drawMesh();
+        Renderer::useMaterial(MaterialLoader::instancedVariants[materialID]);
+        Renderer::useMaterialInstance(materialInstanceID);
 
-        if(depthMask) glDepthMask(GL_TRUE);
+        Renderer::drawMeshIndirect(firstCommand,count);
     }
 
-    void process()  {
+    // Models that can share one indirect draw, only the mesh may differ
+    inline bool sharesState(const Model& model) const
+    {
+        return materialID == model.materialID && materialInstanceID == model.materialInstanceID &&
+               depthMask == model.depthMask && cullBack == model.cullBack;
+    }
+
+    // Models that can share one instanced draw
+    inline bool batchesWith(const Model& model) const
+    {
+        return meshID == model.meshID && materialID == model.materialID && materialInstanceID == model.materialInstanceID &&
+               depthMask == model.depthMask && cullBack == model.cullBack;
+    }
+
+    // Animates the model, true if it moved and ModelLoader::markMoved has to be told
+    bool process()  {
         
-        if (materialID != 3)
+        if (materialID != 3 && !isStatic)
         {
-            transformMatrix = glm::rotate(transformMatrix,0.1f * deltaTime, vec3(0.2,1,0));
+            if (decomposed)
+            {
+                transform.rotate(0.1f * deltaTime, vec3(0.2,1,0));
+                transformMatrix = transform.getMatrix();
+            }
+            else transformMatrix = glm::rotate(transformMatrix,0.1f * deltaTime, vec3(0.2,1,0));
+            return true;
         }
+        return false;
     }
 
-    bool operator<(const Model& model) const
-    {
-        return materialID < model.materialID || 
-            (materialID == model.materialID && (materialInstanceID < model.materialInstanceID || 
-                (model.materialInstanceID == model.materialInstanceID && meshID < model.meshID)));
-    }
 };
 
-bool Model::lastCull = false;
-
 namespace ModelLoader
 {
-    sorted_vector<Model> models;
+    vector<Model> models;           // ModelID -> Model, draw order is decided every frame by Renderer::renderQueue
+    DynamicAABBTree tree;           // World bounds of every model, leaves hold the ModelID
+    vector<ModelID> moved;          // Models whose transform changed since the last refit
+    vector<bool> movedFlags;        // ModelID -> already in moved
+
+    AABB sceneBounds;
+    bool sceneBoundsDirty = false;
 
     ModelID loadModel(const Model& model)
     {
-        return models.push_back(model);
+        models.push_back(model);
+        ModelID id = models.size() - 1;
+        Model& loaded = models[id];
+        loaded.bounds = loaded.worldBounds();
+        loaded.proxy = tree.insert(loaded.bounds,id);
+        sceneBounds = AABB::merge(sceneBounds,loaded.bounds);
+        movedFlags.push_back(false);
+        return id;
     }
 
     inline Model& get(ModelID modelID) { return models[modelID]; }
+
+    // Has to be called after changing the transform of a loaded model, the next refit only looks at these
+    inline void markMoved(ModelID modelID)
+    {
+        if (movedFlags[modelID]) return;
+        movedFlags[modelID] = true;
+        moved.push_back(modelID);
+    }
+
+    /*
+     * Keeps the tree and the scene bounds in sync with the models marked as moved, only models that left their fat
+     * box are reinserted. Growing the scene is immediate, the scene is only recomputed when a model on its border moved
+     */
+    inline void refit()
+    {
+        for (ModelID id : moved)
+        {
+            Model& model = models[id];
+            movedFlags[id] = false;
+            AABB bounds = model.worldBounds();
+            if (bounds.min == model.bounds.min && bounds.max == model.bounds.max) continue;
+
+            if (model.bounds.touches(sceneBounds)) sceneBoundsDirty = true;
+            else if (!sceneBounds.contains(bounds)) sceneBounds = AABB::merge(sceneBounds,bounds);
+
+            model.bounds = bounds;
+            tree.move(model.proxy,bounds);
+        }
+        moved.clear();
+    }
+
+    /*
+     * Bake static: static models sharing material, material instance and raster state are pre-transformed into one
+     * mesh per spatial chunk of chunkSize, so every chunk is still culled on its own. The chunks replace the models,
+     * ModelIDs are renumbered. Chunks are marked baked so baking again leaves them alone, and source meshes no model
+     * draws anymore are freed
+     */
+    void bakeStatic(float chunkSize = 16.0f)
+    {
+        using ChunkKey = tuple<MaterialID,MaterialInstanceID,bool,bool,int,int,int>;
+        map<ChunkKey,vector<ModelID>> chunks;
+        vector<Model> kept;
+        vector<bool> sourceMesh(MeshLoader::meshes.size(),false);
+        size_t staticModels = 0;
+        for (ModelID id = 0; id < models.size(); id++)
+        {
+            const Model& model = models[id];
+            if (!model.isStatic || model.baked)
+            {
+                kept.push_back(model);
+                continue;
+            }
+            vec3 cell = model.bounds.center() / chunkSize;
+            chunks[make_tuple(model.materialID,model.materialInstanceID,model.cullBack,model.depthMask,
+                              int(std::floor(cell.x)),int(std::floor(cell.y)),int(std::floor(cell.z)))].push_back(id);
+            sourceMesh[model.meshID] = true;
+            staticModels++;
+        }
+        if (chunks.empty()) return;
+
+        size_t sourceBytes = 0,bakedBytes = 0,bakedVertices = 0;
+        for (MeshID meshID = 0; meshID < sourceMesh.size(); meshID++)
+            if (sourceMesh[meshID]) sourceBytes += MeshLoader::meshes[meshID].meshBuffer->meshBuffer.size() * sizeof(GLfloat);
+
+        vector<GLfloat> rows;
+        vector<vec3> normals,tangents;
+        for (const auto& chunk : chunks)
+        {
+            rows.clear();
+            normals.clear();
+            tangents.clear();
+            for (ModelID id : chunk.second)
+            {
+                const Model& model = models[id];
+                const Mesh& mesh = MeshLoader::meshes[model.meshID];
+                const MeshBuffer& buffer = *mesh.meshBuffer;
+                const MeshRegion& normalRegion = buffer.regions[REGION_NORMAL];
+                const MeshRegion& tangentRegion = buffer.regions[REGION_TANGENT];
+                mat3 normalMatrix = model.decomposed ? model.transform.normalMatrix() : glm::transpose(glm::inverse(mat3(model.transformMatrix)));
+                mat3 tangentMatrix = mat3(model.transformMatrix);
+
+                for (size_t v = 0; v < mesh.vertexCount; v++)
+                {
+                    const GLfloat* row = &buffer.meshBuffer[v * mesh.vertexStride];
+                    vec3 position = vec3(model.transformMatrix * vec4(row[0],row[1],row[2],1.0f));
+                    GLfloat baked[8] = {position.x,position.y,position.z,row[3],row[4],row[5],0.0f,0.0f};
+                    if (mesh.vertexStride >= 8)
+                    {
+                        baked[6] = row[6];
+                        baked[7] = row[7];
+                    }
+                    rows.insert(rows.end(),baked,baked + 8);
+
+                    normals.push_back(normalRegion.enabled() ? glm::normalize(normalMatrix * *(const vec3*)&buffer.meshBuffer[normalRegion.offset + v * 3]) : vec3(0.0f));
+                    tangents.push_back(tangentRegion.enabled() ? glm::normalize(tangentMatrix * *(const vec3*)&buffer.meshBuffer[tangentRegion.offset + v * 3]) : vec3(0.0f));
+                }
+            }
+
+            MeshID meshID = MeshLoader::loadMesh(MeshLoader::createBakedMesh(rows,normals,tangents));
+            bakedBytes += MeshLoader::meshes[meshID].meshBuffer->meshBuffer.size() * sizeof(GLfloat);
+            bakedVertices += normals.size();
+
+            Model baked = models[chunk.second[0]];
+            baked.meshID = meshID;
+            baked.transformMatrix = mat4(1.0f);
+            baked.normalMatrix = mat3(1.0f);
+            baked.decomposed = false;
+            baked.baked = true;
+            kept.push_back(baked);
+        }
+
+        // Source meshes only the merged models used are freed, shared primitives still drawn on their own stay
+        for (const Model& model : kept) if (model.meshID < sourceMesh.size()) sourceMesh[model.meshID] = false;
+        size_t freedMeshes = 0;
+        for (MeshID meshID = 0; meshID < sourceMesh.size(); meshID++)
+        {
+            if (!sourceMesh[meshID]) continue;
+            MeshLoader::freeMesh(meshID);
+            freedMeshes++;
+        }
+
+        models.clear();
+        moved.clear();
+        movedFlags.clear();
+        tree = DynamicAABBTree();
+        sceneBounds = AABB();
+        for (const Model& model : kept) loadModel(model);
+
+        cerr << "Baked " << staticModels << " static models into " << chunks.size() << " chunks of " << chunkSize << " units: draws "
+             << staticModels << " -> " << chunks.size() << ", vertex memory " << sourceBytes / 1024.0 << " KB in shared meshes -> "
+             << bakedBytes / 1024.0 << " KB baked (" << bakedVertices << " vertices, x" << double(bakedBytes) / std::max<size_t>(sourceBytes,1) << "), "
+             << freedMeshes << " source meshes freed" << endl;
+    }
+
+    const AABB& getSceneBounds()
+    {
+        if (sceneBoundsDirty)
+        {
+            sceneBounds = AABB();
+            for (const Model& model : models) sceneBounds = AABB::merge(sceneBounds,model.bounds);
+            sceneBoundsDirty = false;
+        }
+        return sceneBounds;
+    }
 };
 
 Model createSkyBox()
 {
-    Material cubeMap_material("cubemap",list<string>());
+    Material cubeMap_material("cubemap");
     cubeMap_material.isSkyboxMaterial = true;
 
     MaterialID cubeMap_material_id = MaterialLoader::loadMaterial(cubeMap_material);
@@ -1275,28 +2071,8 @@ namespace Util
 
     VRP getSceneVRP()
     {
-        auto models = ModelLoader::models.native();
-        vec4 min = vec4(vec3(INFINITY),0);
-        vec4 max = vec4(vec3(-INFINITY),0);
-
-        for (size_t i = 0; i <models.size(); i++)
-        {
-            Mesh& mesh = MeshLoader::meshes[models[i].meshID];
-            for (size_t j = 0; j < mesh.vertexCount; j++)
-            {
-                size_t b = mesh.vertexStride * j;
-                vec4 v = mat4(models[i].transformMatrix) * vec4(mesh.meshPtr()[b],mesh.meshPtr()[b + 1],mesh.meshPtr()[b + 2],1.0);
-                
-                min.x = glm::min(v.x,min.x);
-                min.y = glm::min(v.y,min.y);
-                min.z = glm::min(v.z,min.z);
-
-                max.x = glm::max(v.x,max.x);
-                max.y = glm::max(v.y,max.y);
-                max.z = glm::max(v.z,max.z);
-            }
-        }
-        return {min,max};
+        const AABB& bounds = ModelLoader::getSceneBounds();
+        return {vec4(bounds.min,0),vec4(bounds.max,0)};
     }
 }
 namespace Renderer
@@ -1305,41 +2081,732 @@ namespace Renderer
 
     inline void useMaterial(MaterialID materialID)
     {
-        GLuint programID = MaterialLoader::materials[materialID].programID;
         if(MaterialLoader::currentMaterial != materialID)
         {
             MaterialLoader::currentMaterial = materialID;
             MaterialLoader::materials[MaterialLoader::currentMaterial].bind();
             REGISTER_MATERIAL_SWAP();
         }
+    }
 
-        if (MaterialLoader::usedMaterials[MaterialLoader::currentMaterial] != currentFrame)
+    /*
+     * Per object data ring, needs GL 4.4 for persistent mapping. The buffer holds three regions of capacity objects,
+     * the CPU writes the region of the current frame through a coherent persistent mapping while the GPU may still
+     * read the other two, and a fence per region keeps the CPU from overwriting a region still in flight. Shaders
+     * read the objects through a buffer texture, so a draw only sets the objectIndex uniform
+     */
+    struct ObjectData
+    {
+        vec4 transformMatrix[4];
+        vec4 normalMatrix[3];               // mat3 columns padded to texels
+    };
+
+    struct ObjectRing
+    {
+        const static size_t regions = 3;
+
+        bool enabled = false;
+        size_t capacity = 0;
+        GLuint buffer = 0;
+        TextureID texture = -1;
+        ObjectData* mapped = nullptr;
+        GLsync fences[regions] = {0};
+        size_t region = 0;
+        size_t count = 0;
+
+        size_t totalWaits = 0;
+        double totalWaitMs = 0.0;
+
+        void create(size_t _capacity)
+        {
+            if (buffer != 0)
+            {
+                glFinish();
+                for (GLsync& fence : fences) if (fence) { glDeleteSync(fence); fence = 0; }
+                glBindBuffer(GL_TEXTURE_BUFFER,buffer);
+                glUnmapBuffer(GL_TEXTURE_BUFFER);
+                glDeleteBuffers(1,&buffer);
+            }
+
+            capacity = _capacity;
+            GLsizeiptr size = regions * capacity * sizeof(ObjectData);
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glGenBuffers(1,&buffer);
+            glBindBuffer(GL_TEXTURE_BUFFER,buffer);
+            glBufferStorage(GL_TEXTURE_BUFFER,size,nullptr,flags);
+            mapped = (ObjectData*)glMapBufferRange(GL_TEXTURE_BUFFER,0,size,flags);
+
+            if (texture == -1)
+            {
+                GLuint texId;
+                glGenTextures(1,&texId);
+                Texture::glTexturesIds.push_back(texId);
+                texture = Texture::glTexturesIds.size() - 1;
+            }
+            glState.bindTexture(Texture::objectDataUnit,GL_TEXTURE_BUFFER,Texture::glTexturesIds[texture]);
+            glTexBuffer(GL_TEXTURE_BUFFER,GL_RGBA32F,buffer);
+        }
+
+        // Waits until the GPU is done with the region of this frame, time spent here means the CPU got ahead
+        void beginFrame(size_t objects)
+        {
+            if (objects > capacity) create(std::max(objects * 2,size_t(1024)));
+
+            if (fences[region])
+            {
+                GLenum status = glClientWaitSync(fences[region],0,0);
+                if (status == GL_TIMEOUT_EXPIRED)
+                {
+                    double start = glfwGetTime();
+                    while (glClientWaitSync(fences[region],GL_SYNC_FLUSH_COMMANDS_BIT,1000000) == GL_TIMEOUT_EXPIRED);
+                    double ms = (glfwGetTime() - start) * 1000.0;
+                    totalWaits++;
+                    totalWaitMs += ms;
+                    REGISTER_FENCE_WAIT(ms);
+                }
+                glDeleteSync(fences[region]);
+                fences[region] = 0;
+            }
+            count = 0;
+            Texture::useTexture(texture,Texture::objectDataUnit,GL_TEXTURE_BUFFER);
+        }
+
+        /*
+         * A frame pushing more than beginFrame was told grows the ring on the spot. create() waits for the GPU, so the
+         * draws already issued are done with the old buffer and the rest of the frame goes on in the new one
+         */
+        inline GLint push(const mat4& transformMatrix,const mat3& normalMatrix)
+        {
+            if (count == capacity) create(capacity * 2);
+            size_t index = region * capacity + count++;
+            ObjectData& object = mapped[index];
+            for (int c = 0; c < 4; c++) object.transformMatrix[c] = transformMatrix[c];
+            for (int c = 0; c < 3; c++) object.normalMatrix[c] = vec4(normalMatrix[c],0.0f);
+            return index;
+        }
+
+        void endFrame()
+        {
+            fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE,0);
+            region = (region + 1) % regions;
+        }
+    };
+
+    ObjectRing objectRing;
+
+    inline void useObject(const mat4& transformMatrix,const mat3& normalMatrix)
+    {
+        const vector<GLuint>& uniformVector = MaterialLoader::current();
+        if (uniformVector[UNIFORM_OBJECT_INDEX] != -1)
+        {
+            glUniform1i(uniformVector[UNIFORM_OBJECT_INDEX],objectRing.push(transformMatrix,normalMatrix));
+            return;
+        }
+
+        if(uniformVector[UNIFORM_TRANSFORM_MATRIX] != -1)
         {
-            MaterialLoader::usedMaterials[MaterialLoader::currentMaterial] = currentFrame;
-            Scene::flush();
-            Light::flush();
+            glUniformMatrix4fv(uniformVector[UNIFORM_TRANSFORM_MATRIX],1,false,&transformMatrix[0][0]);
+        }
+
+        if (uniformVector[UNIFORM_NORMAL_MATRIX] != -1)
+        {
+            glUniformMatrix3fv(uniformVector[UNIFORM_NORMAL_MATRIX],1,false,&normalMatrix[0][0]);
         }
     }
 
-    inline void useMesh(MeshID meshID)
+    /*
+     * std140 mirror of the SceneBlock in materials/scene.glsl, written once per frame and bound at sceneBlockBinding
+     * for every program
+     */
+    struct SceneBlock
     {
-        if (meshID != MeshLoader::currentMesh)
+        mat4 projectionMatrix;
+        mat4 viewMatrix;
+        vec3 viewPos;
+        float time;
+        vec4 lightPosition[Light::maxLights];   // vec3 arrays have a 16 byte stride in std140
+        vec4 lightColor[Light::maxLights];
+        GLint lightCount;
+        GLint padding[3];
+        GLint clusterGrid[4];
+        vec4 clusterDepth;                      // xy slice scale and bias, zw screen size
+    };
+    static_assert(sizeof(SceneBlock) == 384,"SceneBlock doesn't match the std140 layout");
+
+    GLuint sceneBlockBuffer = 0;
+    SceneBlock sceneBlock;
+
+    void updateSceneBlock()
+    {
+        const Camera& camera = CameraLoader::cameras[Scene::currentCamera];
+        sceneBlock.projectionMatrix = camera.projectionMatrix;
+        sceneBlock.viewMatrix = camera.viewMatrix;
+        sceneBlock.viewPos = vec3(camera.invViewMatrix[3]);
+        sceneBlock.time = Scene::time;
+
+        sceneBlock.lightCount = std::min(Light::lightsPositions.size(),Light::maxLights);
+        for (GLint i = 0; i < sceneBlock.lightCount; i++)
+        {
+            sceneBlock.lightPosition[i] = vec4(Light::lightsPositions[i],1.0f);
+            sceneBlock.lightColor[i] = vec4(Light::lightsColor[i],1.0f);
+        }
+
+        const Clusters::Grid& grid = Light::clusters.grid;
+        sceneBlock.clusterGrid[0] = grid.x;
+        sceneBlock.clusterGrid[1] = grid.y;
+        sceneBlock.clusterGrid[2] = grid.z;
+        sceneBlock.clusterDepth = vec4(grid.sliceScale(),grid.sliceBias(),Viewport::screenWidth,Viewport::screenHeight);
+
+        if (sceneBlockBuffer == 0)
         {
-            MeshLoader::currentMesh = meshID;
-            glBindVertexArray(MeshLoader::meshes[MeshLoader::currentMesh].vao);
-            REGISTER_MESH_SWAP();
+            glGenBuffers(1,&sceneBlockBuffer);
+            glBindBuffer(GL_UNIFORM_BUFFER,sceneBlockBuffer);
+            glBufferData(GL_UNIFORM_BUFFER,sizeof(SceneBlock),nullptr,GL_DYNAMIC_DRAW);
+            glBindBufferBase(GL_UNIFORM_BUFFER,sceneBlockBinding,sceneBlockBuffer);
         }
+        glBindBuffer(GL_UNIFORM_BUFFER,sceneBlockBuffer);
+        glBufferSubData(GL_UNIFORM_BUFFER,0,sizeof(SceneBlock),&sceneBlock);
+        REGISTER_UNIFORM_FLUSH();
+    }
+
+    inline void useMesh(MeshID meshID)
+    {
+        MeshLoader::currentMesh = meshID;
+        if (glState.bindVertexArray(MeshLoader::meshes[meshID].vao)) REGISTER_MESH_SWAP();
     }
     
     inline void drawMesh()
     {
         glDrawArrays(GL_TRIANGLES,0,MeshLoader::meshes[MeshLoader::currentMesh].vertexCount);
+        REGISTER_DRAW_CALL(1);
+    }
+
+    /*
+     * Per instance attributes, a mat4 transform in locations 5 to 8 and a mat3 normal matrix in 9 to 11
+     */
+    struct InstanceData
+    {
+        mat4 transformMatrix;
+        mat3 normalMatrix;
+    };
+
+    const static GLuint instanceAttribute = 5;
+    const static size_t minInstances = 2;
+
+    GLuint instanceBuffer = 0;
+    vector<InstanceData> instanceData;
+
+    inline void uploadInstances()
+    {
+        if (instanceBuffer == 0) glGenBuffers(1,&instanceBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER,instanceBuffer);
+        glBufferData(GL_ARRAY_BUFFER,instanceData.size() * sizeof(InstanceData),instanceData.empty() ? nullptr : &instanceData[0],GL_STREAM_DRAW);
+    }
+
+    inline void bindInstanceAttributes(size_t base)
+    {
+        for (GLuint c = 0; c < 4; c++)
+        {
+            GLuint location = instanceAttribute + c;
+            glVertexAttribPointer(location,4,GL_FLOAT,GL_FALSE,sizeof(InstanceData),(void*)(base + offsetof(InstanceData,transformMatrix) + c * sizeof(vec4)));
+            glEnableVertexAttribArray(location);
+            glVertexAttribDivisor(location,1);
+        }
+        for (GLuint c = 0; c < 3; c++)
+        {
+            GLuint location = instanceAttribute + 4 + c;
+            glVertexAttribPointer(location,3,GL_FLOAT,GL_FALSE,sizeof(InstanceData),(void*)(base + offsetof(InstanceData,normalMatrix) + c * sizeof(vec3)));
+            glEnableVertexAttribArray(location);
+            glVertexAttribDivisor(location,1);
+        }
+    }
+
+    // GL 3.3 has no base instance, the attribute pointers of the bound mesh are moved to the first instance instead
+    inline void drawMeshInstanced(size_t firstInstance,size_t count)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER,instanceBuffer);
+        bindInstanceAttributes(firstInstance * sizeof(InstanceData));
+
+        glDrawArraysInstanced(GL_TRIANGLES,0,MeshLoader::meshes[MeshLoader::currentMesh].vertexCount,count);
+        REGISTER_DRAW_CALL(count);
+    }
+
+    /*
+     * Multi draw indirect path, needs GL 4.3. All meshes live in the mesh pool, every visible model is one command
+     * whose base instance selects its entry in the per draw buffer
+     */
+    struct DrawArraysIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint first;
+        GLuint baseInstance;
+    };
+
+    bool multiDraw = false;
+    GLuint indirectBuffer = 0,drawDataBuffer;
+    vector<DrawArraysIndirectCommand> drawCommands;
+    vector<InstanceData> drawData;
+
+    inline void drawMeshIndirect(size_t firstCommand,size_t count)
+    {
+        MeshLoader::currentMesh = MeshLoader::poolMeshID;
+        if (glState.bindVertexArray(MeshLoader::poolVAO)) REGISTER_MESH_SWAP();
+        glMultiDrawArraysIndirect(GL_TRIANGLES,(void*)(firstCommand * sizeof(DrawArraysIndirectCommand)),count,0);
+        REGISTER_DRAW_CALL(count);
     }
 
     inline void useMaterialInstance(MaterialInstanceID instanceID)
     {
         MaterialLoader::materials[MaterialLoader::currentMaterial].useInstance(instanceID);
     }
+
+    vector<mat4> transformBuffer;
+    vector<mat3> normalBuffer;
+
+    Culling::SphereBatch modelSpheres;
+    vector<size_t> visibleModels;
+
+    /*
+     * Tests the world bounding sphere of every model against the current camera frustum,
+     * only the indexs left in visibleModels are drawn
+     */
+    void cullModels(const vector<Model>& models)
+    {
+        const Camera& camera = CameraLoader::cameras[Scene::currentCamera];
+        Culling::Frustum frustum = Culling::extractFrustum(camera.projectionMatrix * camera.viewMatrix);
+
+        modelSpheres.clear();
+        for (const Model& model : models)
+        {
+            vec3 center;
+            float radius;
+            Culling::transformSphere(model.transformMatrix,MeshLoader::meshes[model.meshID].boundingSphere,center,radius);
+            modelSpheres.push_back(center,radius);
+        }
+
+        Culling::cull(frustum,modelSpheres,visibleModels);
+        REGISTER_CULLING(visibleModels.size(),models.size() - visibleModels.size());
+    }
+
+    RenderQueue renderQueue;
+    bool frontToBack = false;       // Depth buckets before state, and the skybox drawn last
+    bool overdraw = false;          // Draws the queue with the overdraw counting debug material
+
+    /*
+     * Sorts the visible models by material, instance, mesh and then front to back view depth, or in front to back
+     * mode by coarse depth bucket first
+     */
+    void buildRenderQueue(const vector<Model>& models)
+    {
+        const Camera& camera = CameraLoader::cameras[Scene::currentCamera];
+        renderQueue.clear();
+        for (size_t index : visibleModels)
+        {
+            const Model& model = models[index];
+            float depth = -(camera.viewMatrix * vec4(model.bounds.center(),1.0f)).z;
+            uint64_t key = frontToBack ? renderQueue.makeFrontToBackKey(model.materialID,model.materialInstanceID,model.meshID,depth) :
+                                         renderQueue.makeKey(model.materialID,model.materialInstanceID,model.meshID,depth);
+            renderQueue.push(key,index);
+            if (RenderQueue::saturates(model.materialID,model.materialInstanceID,model.meshID)) REGISTER_SATURATED_KEY();
+        }
+        renderQueue.sort();
+    }
+
+    /*
+     * Depth pre-pass. The opaque models of the queue are first drawn with the position only depth material and color
+     * writes off, then the main pass shades with GL_EQUAL and depth writes off, so every covered pixel runs its
+     * material once. PREPASS_AUTO measures the overdraw ratio every prepassMeasureInterval frames, the pre-pass
+     * depth samples that passed over the samples shaded by the main pass, and keeps the pre-pass while the ratio is at
+     * least prepassMinOverdraw, below it the extra vertex work costs more than the fragments it saves
+     */
+    enum DepthPrepassMode { PREPASS_OFF = 0, PREPASS_ON, PREPASS_AUTO };
+    DepthPrepassMode depthPrepassMode = PREPASS_OFF;
+    const static size_t prepassMeasureInterval = 120;
+    const float prepassMinOverdraw = 1.5f;
+
+    bool depthPrepass = false;          // This frame runs the pre-pass
+    bool depthEqualPass = false;        // Main pass after the pre-pass, see setRaster
+    bool prepassMeasuring = false,prepassPending = false,prepassAuto = false;
+    GLuint prepassQueries[2] = {0,0};   // Samples passed in the pre-pass, in the main pass
+    size_t prepassFrame = 0,prepassFrames = 0;
+    float measuredOverdraw = 0.0f;
+
+    // Models drawn without writing depth don't take part in the pre-pass and are depth tested as usual
+    inline void setRaster(bool cullBack,bool depthMask)
+    {
+        glState.setCullMode(cullBack ? GL_BACK : GL_FRONT);
+        if (depthEqualPass)
+        {
+            glState.setDepthFunc(depthMask ? GL_LESS : GL_EQUAL);
+            glState.setDepthMask(false);
+        }
+        else glState.setDepthMask(!depthMask);
+    }
+
+    // Decides if this frame runs the pre-pass, in auto mode reading back the last measurement first
+    void updateDepthPrepass()
+    {
+        if (depthPrepassMode != PREPASS_AUTO)
+        {
+            depthPrepass = depthPrepassMode == PREPASS_ON;
+            prepassMeasuring = false;
+        }
+        else
+        {
+            if (prepassQueries[0] == 0) glGenQueries(2,prepassQueries);
+            if (prepassPending)
+            {
+                GLuint depthSamples = 0,shadedSamples = 0;
+                glGetQueryObjectuiv(prepassQueries[0],GL_QUERY_RESULT,&depthSamples);
+                glGetQueryObjectuiv(prepassQueries[1],GL_QUERY_RESULT,&shadedSamples);
+                measuredOverdraw = shadedSamples ? float(depthSamples) / float(shadedSamples) : 0.0f;
+                prepassAuto = measuredOverdraw >= prepassMinOverdraw;
+                prepassPending = false;
+            }
+            prepassMeasuring = prepassFrame++ % prepassMeasureInterval == 0;
+            depthPrepass = prepassMeasuring || prepassAuto;
+        }
+        prepassFrames += depthPrepass;
+    }
+
+    inline void beginDepthPrepass()
+    {
+        glState.setColorMask(false);
+        glState.setDepthFunc(GL_LESS);
+        if (prepassMeasuring) glBeginQuery(GL_SAMPLES_PASSED,prepassQueries[0]);
+    }
+
+    inline void beginEqualPass()
+    {
+        if (prepassMeasuring)
+        {
+            glEndQuery(GL_SAMPLES_PASSED);
+            glBeginQuery(GL_SAMPLES_PASSED,prepassQueries[1]);
+        }
+        glState.setColorMask(true);
+        depthEqualPass = true;
+    }
+
+    inline void endEqualPass()
+    {
+        if (prepassMeasuring)
+        {
+            glEndQuery(GL_SAMPLES_PASSED);
+            prepassPending = true;
+        }
+        depthEqualPass = false;
+        glState.setDepthFunc(GL_LESS);
+    }
+
+    // Pre-pass model by model in queue order, for the overdraw view and the draws without an instanced variant
+    void drawDepthPrepass(const vector<Model>& models,size_t begin,size_t end)
+    {
+        useMaterial(MaterialLoader::depthMaterialID);
+        for (size_t i = begin; i < end; i++)
+        {
+            const Model& model = models[renderQueue[i]];
+            if (model.depthMask) continue;
+            setRaster(model.cullBack,false);
+            useMesh(model.meshID);
+            useObject(model.transformMatrix,model.normalMatrix);
+            drawMesh();
+        }
+    }
+
+    // The skybox sits on the far plane, drawn last it is only shaded where nothing else was drawn
+    inline void drawSkyBox(Model& skyBox)
+    {
+        glState.setDepthFunc(GL_LEQUAL);
+        skyBox.draw();
+        glState.setDepthFunc(GL_LESS);
+    }
+
+    /*
+     * Draws the render queue in its order with the debug material, additively blending a fixed step per shaded
+     * fragment, so the frame shows how often every pixel was shaded
+     */
+    void drawOverdraw(const vector<Model>& models)
+    {
+        if (depthPrepass)
+        {
+            beginDepthPrepass();
+            drawDepthPrepass(models,0,renderQueue.size());
+            beginEqualPass();
+        }
+        glState.setBlend(true);
+        glState.setBlendFunc(GL_ONE,GL_ONE);
+        useMaterial(MaterialLoader::overdrawMaterialID);
+        useMaterialInstance(MaterialLoader::overdrawMaterialInstanceID);
+        for (size_t i = 0; i < renderQueue.size(); i++)
+        {
+            const Model& model = models[renderQueue[i]];
+            model.useState();
+            useMesh(model.meshID);
+            useObject(model.transformMatrix,model.normalMatrix);
+            drawMesh();
+        }
+        glState.setBlend(false);
+        if (depthPrepass) endEqualPass();
+    }
+
+    // Average times a covered pixel was shaded, read back from the overdraw frame
+    double readOverdraw()
+    {
+        vector<unsigned char> pixels(size_t(Viewport::screenWidth) * size_t(Viewport::screenHeight) * 4);
+        glReadPixels(0,0,Viewport::screenWidth,Viewport::screenHeight,GL_RGBA,GL_UNSIGNED_BYTE,&pixels[0]);
+
+        size_t covered = 0,shaded = 0;
+        for (size_t i = 0; i < pixels.size(); i += 4)
+        {
+            size_t layers = (pixels[i] + 4) / 8;
+            covered += layers != 0;
+            shaded += layers;
+        }
+        return covered ? double(shaded) / covered : 0.0;
+    }
+
+    /*
+     * A range of the render queue drawn as one unit, a single model or a run of models sharing mesh, material and
+     * instance that goes in one instanced call when their material has an instanced variant
+     */
+    struct DrawRun
+    {
+        size_t begin,end;
+        size_t firstInstance;       // -1 for single models
+    };
+    vector<DrawRun> drawRuns;
+
+    const static size_t parallelRecordThreshold = 1024;        // Runs, below it one list is recorded on the GL thread
+    vector<CommandList> commandLists;
+
+    vector<CommandList> prepassLists;
+
+    /*
+     * Records the draws of a slice of drawRuns, runs with instances also write their transforms to instanceData.
+     * Only reads the models and the loaders, several slices are recorded at the same time. depthOnly records the
+     * pre-pass of the slice instead, with the depth material and reusing the instances written by the main recording
+     */
+    void recordRuns(const vector<Model>& models,size_t begin,size_t end,CommandList& list,bool depthOnly = false)
+    {
+        CommandRecorder recorder(list);
+        for (size_t r = begin; r < end; r++)
+        {
+            const DrawRun& run = drawRuns[r];
+            const Model& model = models[renderQueue[run.begin]];
+            bool instanced = run.firstInstance != -1;
+            if (depthOnly && model.depthMask) continue;
+
+            MaterialID materialID = depthOnly ? MaterialLoader::depthMaterialID : model.materialID;
+            recorder.setRaster(model.cullBack,model.depthMask);
+            recorder.useMaterial(instanced ? MaterialLoader::instancedVariants[materialID] : materialID);
+            if (!depthOnly) recorder.useMaterialInstance(model.materialInstanceID);
+            recorder.useMesh(model.meshID);
+
+            if (instanced)
+            {
+                if (!depthOnly) for (size_t k = run.begin; k < run.end; k++)
+                {
+                    const Model& instance = models[renderQueue[k]];
+                    instanceData[run.firstInstance + k - run.begin] = {instance.transformMatrix,instance.normalMatrix};
+                }
+                recorder.drawInstanced(run.firstInstance,run.end - run.begin);
+            }
+            else
+            {
+                recorder.setObject(model.transformMatrix,model.normalMatrix);
+                recorder.draw();
+            }
+        }
+    }
+
+    void replay(const CommandList& list)
+    {
+        CommandList::Reader reader = list.reader();
+        CommandList::Opcode opcode;
+        while (reader.next(opcode))
+        {
+            switch (opcode)
+            {
+                case CommandList::USE_MATERIAL:
+                useMaterial(reader.read<uint32_t>()); break;
+                case CommandList::USE_MATERIAL_INSTANCE:
+                {
+                    uint32_t instanceID = reader.read<uint32_t>();
+                    useMaterialInstance(instanceID == CommandRecorder::none ? MaterialInstanceID(-1) : instanceID);
+                    break;
+                }
+                case CommandList::USE_MESH:
+                useMesh(reader.read<uint32_t>()); break;
+                case CommandList::SET_RASTER:
+                {
+                    bool cullBack = reader.read<uint8_t>();
+                    setRaster(cullBack,reader.read<uint8_t>());
+                    break;
+                }
+                case CommandList::SET_OBJECT:
+                {
+                    mat4 transformMatrix = reader.read<mat4>();
+                    mat3 normalMatrix = reader.read<mat3>();
+                    useObject(transformMatrix,normalMatrix);
+                    break;
+                }
+                case CommandList::DRAW:
+                drawMesh(); break;
+                case CommandList::DRAW_INSTANCED:
+                {
+                    uint32_t firstInstance = reader.read<uint32_t>();
+                    drawMeshInstanced(firstInstance,reader.read<uint32_t>());
+                    break;
+                }
+            }
+        }
+    }
+
+    /*
+     * Draws the render queue. The queue is split in runs on the GL thread, then worker threads record a slice of the
+     * runs each into their own command list and the lists are replayed here in order, all the pre-pass lists first
+     * when the depth pre-pass is on
+     */
+    void drawQueue(vector<Model>& models)
+    {
+        drawRuns.clear();
+        size_t instanceCount = 0;
+        for (size_t i = 0,j; i < renderQueue.size(); i = j)
+        {
+            const Model& first = models[renderQueue[i]];
+            for (j = i + 1; j < renderQueue.size() && first.batchesWith(models[renderQueue[j]]); j++);
+
+            if (j - i >= minInstances && MaterialLoader::instancedVariants[first.materialID] != -1)
+            {
+                drawRuns.push_back({i,j,instanceCount});
+                instanceCount += j - i;
+            }
+            else for (size_t k = i; k < j; k++) drawRuns.push_back({k,k + 1,size_t(-1)});
+        }
+        instanceData.resize(instanceCount);
+
+        int lists = 1;
+        #ifdef _OPENMP
+        if (drawRuns.size() >= parallelRecordThreshold) lists = omp_get_max_threads();
+        #endif
+        if (commandLists.size() < lists) commandLists.resize(lists);
+        if (prepassLists.size() < lists) prepassLists.resize(lists);
+
+        #pragma omp parallel for num_threads(lists) schedule(static,1) if (lists > 1)
+        for (int t = 0; t < lists; t++)
+        {
+            size_t begin = drawRuns.size() * t / lists,end = drawRuns.size() * (t + 1) / lists;
+            commandLists[t].clear();
+            recordRuns(models,begin,end,commandLists[t]);
+            prepassLists[t].clear();
+            if (depthPrepass) recordRuns(models,begin,end,prepassLists[t],true);
+        }
+
+        if (instanceCount) uploadInstances();
+        if (depthPrepass)
+        {
+            beginDepthPrepass();
+            for (int t = 0; t < lists; t++) replay(prepassLists[t]);
+            beginEqualPass();
+        }
+        for (int t = 0; t < lists; t++) replay(commandLists[t]);
+        if (depthPrepass) endEqualPass();
+    }
+
+    struct DrawBatch
+    {
+        size_t begin,end;           // Range in the render queue, also the range of its commands
+        bool indirect;
+    };
+    vector<DrawBatch> drawBatches;
+
+    /*
+     * Draws the render queue with one glMultiDrawArraysIndirect per run of models sharing material, material instance
+     * and cull state. Commands and per draw data are filled by worker threads and uploaded once, materials without an
+     * instanced variant fall back to drawing model by model
+     */
+    void drawQueueIndirect(vector<Model>& models)
+    {
+        MeshLoader::buildPool();
+
+        drawBatches.clear();
+        for (size_t i = 0,j; i < renderQueue.size(); i = j)
+        {
+            const Model& first = models[renderQueue[i]];
+            for (j = i + 1; j < renderQueue.size() && first.sharesState(models[renderQueue[j]]); j++);
+            drawBatches.push_back({i,j,MaterialLoader::instancedVariants[first.materialID] != -1});
+        }
+
+        drawCommands.resize(renderQueue.size());
+        drawData.resize(renderQueue.size());
+        #pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < renderQueue.size(); i++)
+        {
+            const Model& model = models[renderQueue[i]];
+            drawCommands[i] = {GLuint(MeshLoader::meshes[model.meshID].vertexCount),1,GLuint(MeshLoader::poolFirstVertex[model.meshID]),GLuint(i)};
+            drawData[i] = {model.transformMatrix,model.normalMatrix};
+        }
+
+        if (indirectBuffer == 0)
+        {
+            glGenBuffers(1,&indirectBuffer);
+            glGenBuffers(1,&drawDataBuffer);
+            glState.bindVertexArray(MeshLoader::poolVAO);
+            glBindBuffer(GL_ARRAY_BUFFER,drawDataBuffer);
+            bindInstanceAttributes(0);
+        }
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER,indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER,drawCommands.size() * sizeof(DrawArraysIndirectCommand),drawCommands.empty() ? nullptr : &drawCommands[0],GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER,drawDataBuffer);
+        glBufferData(GL_ARRAY_BUFFER,drawData.size() * sizeof(InstanceData),drawData.empty() ? nullptr : &drawData[0],GL_STREAM_DRAW);
+
+        if (depthPrepass)
+        {
+            beginDepthPrepass();
+            for (const DrawBatch& batch : drawBatches)
+            {
+                const Model& first = models[renderQueue[batch.begin]];
+                if (first.depthMask) continue;
+                if (!batch.indirect)
+                {
+                    drawDepthPrepass(models,batch.begin,batch.end);
+                    continue;
+                }
+                setRaster(first.cullBack,false);
+                useMaterial(MaterialLoader::instancedVariants[MaterialLoader::depthMaterialID]);
+                drawMeshIndirect(batch.begin,batch.end - batch.begin);
+            }
+            beginEqualPass();
+        }
+        for (const DrawBatch& batch : drawBatches)
+        {
+            if (batch.indirect) models[renderQueue[batch.begin]].drawIndirect(batch.begin,batch.end - batch.begin);
+            else for (size_t i = batch.begin; i < batch.end; i++) models[renderQueue[i]].draw();
+        }
+        if (depthPrepass) endEqualPass();
+    }
+
+    /*
+     * Computes the normal matrices of all models before drawing, decomposed models use the closed form
+     * and the rest go through the batched kernel
+     */
+    void updateNormalMatrices(vector<Model>& models)
+    {
+        transformBuffer.clear();
+        for (size_t i = 0; i < models.size(); i++)
+        {
+            if (models[i].decomposed) models[i].normalMatrix = models[i].transform.normalMatrix();
+            else transformBuffer.push_back(models[i].transformMatrix);
+        }
+        if (transformBuffer.empty()) return;
+
+        normalBuffer.resize(transformBuffer.size());
+        MatrixKernels::normalMatrices(&transformBuffer[0],&normalBuffer[0],transformBuffer.size());
+
+        for (size_t i = 0,j = 0; i < models.size(); i++)
+            if (!models[i].decomposed) models[i].normalMatrix = normalBuffer[j++];
+    }
     namespace Ui
     {
         inline void setup_ui(Window* window)
@@ -1393,15 +2860,20 @@ namespace Renderer
             ImGui::Render();
         }
     };
-    int render_loop(Window* window)
+    /*
+     * Runs until the window is closed, or for frameLimit frames when benchmarking
+     */
+    int render_loop(Window* window,size_t frameLimit = 0)
     {
-        glEnable(GL_CULL_FACE);
-        glCullFace(GL_FRONT);  
-        glEnable(GL_DEPTH_TEST);    
+        glState.setCullFace(true);
+        glState.setCullMode(GL_FRONT);
+        glState.setDepthTest(true);
+        glState.setDepthFunc(GL_LESS);
+        glState.setBlend(false);
+        glState.setViewport(0,0,Viewport::screenWidth,Viewport::screenHeight);
         glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
         
-        auto& models = ModelLoader::models.native();
-        bool inverseOrder = false;
+        auto& models = ModelLoader::models;
         Model skyBox =     createSkyBox({
 
             "sky/right.jpg",
@@ -1418,49 +2890,83 @@ namespace Renderer
             "night-skyboxes/SwedishRoyalCastle/negy.jpg",
             "night-skyboxes/SwedishRoyalCastle/posz.jpg",
             "night-skyboxes/SwedishRoyalCastle/negz.jpg" */ });
+
+        double startTime = glfwGetTime();
+        size_t startCalls = glState.calls,startSkipped = glState.skipped;
+        #ifdef DEBUG
+        size_t startTextureSwaps = Debug::totalTextureSwaps;
+        #endif
+        size_t frames = 0;
+        double overdrawAverage = 0.0;
         do{
 
             REGISTER_FRAME();
             currentFrame++;
 
             glClearColor(0.0,0.0,0.0,1.0);
+            glState.setDepthMask(true);         // The clear is masked too
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
             
             Scene::time += deltaTime;
             Scene::update();
-            skyBox.draw();
-            if (inverseOrder)
-            {
-                for(int i = 0; i < models.size(); i++)
-                {
-                    models[i].process();
-                    models[i].draw();
-                }
-            }
-            else
-            {
-                for(int i = models.size() - 1; i >= 0; i--)
-                {
-                    models[i].process();
-                    models[i].draw();
-                }
-            }
-            inverseOrder = !inverseOrder;
+            if (MaterialLoader::clusteredMaterialID != -1) Light::updateClusters(CameraLoader::cameras[Scene::currentCamera]);
+            updateSceneBlock();
+            MaterialInstanceLoader::upload();
+            updateDepthPrepass();
+            // Every model at most once per pass and the skybox
+            if (objectRing.enabled) objectRing.beginFrame(models.size() * (depthPrepass ? 2 : 1) + 1);
+            bool skyBoxLast = frontToBack || depthPrepass;
+            if (!skyBoxLast && !overdraw) drawSkyBox(skyBox);
+
+            for(int i = 0; i < models.size(); i++) if (models[i].process()) ModelLoader::markMoved(i);
+            ModelLoader::refit();
+            updateNormalMatrices(models);
+            cullModels(models);
+            buildRenderQueue(models);
+            if (overdraw) drawOverdraw(models);
+            else if (multiDraw) drawQueueIndirect(models);
+            else drawQueue(models);
+            if (skyBoxLast && !overdraw) drawSkyBox(skyBox);
+            if (overdraw && frames + 1 == frameLimit) overdrawAverage = readOverdraw();
+
+            if (objectRing.enabled) objectRing.endFrame();
 
             Ui::render_ui();
-            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());     //For ui
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());     //For ui, restores the GL state it changes
 
             glfwSwapBuffers(window);
             glfwPollEvents();
 
             LOG_FRAME();
-
-            Light::flushUniforms = false;
+            frames++;
         
         }
         while( glfwGetKey(window, GLFW_KEY_ESCAPE ) != GLFW_PRESS &&
-               glfwWindowShouldClose(window) == 0 );
-    
+               glfwWindowShouldClose(window) == 0 && frames != frameLimit);
+
+        if (frameLimit)
+        {
+            glFinish();
+            double elapsed = glfwGetTime() - startTime;
+            cout << frames << " frames, " << models.size() << " models, " << Light::lightsPositions.size() << " lights, " <<
+                    (multiDraw ? "multi draw indirect, " : "direct draws, ") << 1000.0 * elapsed / frames << " ms/frame" << endl;
+            cout << "GL state calls: " << double(glState.calls - startCalls) / frames << " per frame, " <<
+                    double(glState.skipped - startSkipped) / frames << " redundant ones skipped" << endl;
+            #ifdef DEBUG
+            cout << "texture swaps: " << double(Debug::totalTextureSwaps - startTextureSwaps) / frames << " per frame" <<
+                    (Texture::textureArrays ? " with texture arrays" : "") << endl;
+            #endif
+            if (overdraw)
+                cout << "overdraw: covered pixels shaded " << overdrawAverage << " times on average" << (frontToBack ? ", front to back" : "") << endl;
+            if (depthPrepassMode == PREPASS_ON)
+                cout << "depth pre-pass: on" << endl;
+            else if (depthPrepassMode == PREPASS_AUTO)
+                cout << "depth pre-pass: auto, on " << prepassFrames << " of " << frames << " frames, measured overdraw " << measuredOverdraw << endl;
+            cout << "material instances: " << MaterialInstanceLoader::materialInstances.size() << ", " <<
+                    MaterialInstanceLoader::memory() << " bytes on the CPU, " << MaterialInstanceLoader::bufferSize << " bytes of instance buffer" << endl;
+            if (objectRing.enabled)
+                cout << "object ring: " << objectRing.totalWaits << " fence waits, " << objectRing.totalWaitMs << " ms waiting" << endl;
+        }
         return 0;
     }
 };
@@ -1479,20 +2985,32 @@ void loadSpecificMaterials()
     container.setTexture(Texture::loadTexture(TextureData("metal_normal.jpg")),2);
     MaterialInstanceLoader::loadMaterialInstance(container);
 
-    MaterialLoader::loadMaterial(Material("primitive",list<string>()));
-    MaterialLoader::loadMaterial(Material("emissive",{"emissive","factor"}));
-    Material light("light",{"shinness"});
+    MaterialLoader::loadMaterial(Material("primitive"));
+    MaterialLoader::loadMaterial(Material("emissive"));
+    Material light("light");
 
-    MaterialLoader::loadMaterial(light);
-    MaterialLoader::debugMaterialID = MaterialLoader::loadMaterial(Material("unshaded",{"shadecolor"}));
+    MaterialID lightID = MaterialLoader::loadMaterial(light);
+    MaterialLoader::debugMaterialID = MaterialLoader::loadMaterial(Material("unshaded"));
     MaterialLoader::debugMaterialInstanceID = MaterialInstanceLoader::loadMaterialInstance(MaterialInstance({vec4(1.0,1.0,1.0,1.0)}));
 
-    Material debug("unshaded",list<string>());
-    Material textured("textured",list<string>());
+    MaterialLoader::clusteredMaterialID = MaterialLoader::loadMaterial(Material("clustered"));
+
+    MaterialLoader::loadInstancedVariant(lightID,Material("light","_instanced"));
+    MaterialLoader::loadInstancedVariant(MaterialLoader::clusteredMaterialID,Material("clustered","_instanced"));
+
+    Material debug("unshaded");
+    Material textured("textured");
     MaterialLoader::loadMaterial(textured);
 
-    Material textured2("textured",list<string>());
+    Material textured2("textured");
     MaterialLoader::loadMaterial(textured2);
+
+    // Every shaded fragment adds 8 in an 8 bit channel, so up to 31 layers are counted exactly
+    MaterialLoader::overdrawMaterialID = MaterialLoader::loadMaterial(Material("debug"));
+    MaterialLoader::overdrawMaterialInstanceID = MaterialInstanceLoader::loadMaterialInstance(MaterialInstance({Uniform(8.0f / 255.0f)}));
+
+    MaterialLoader::depthMaterialID = MaterialLoader::loadMaterial(Material("depth"));
+    MaterialLoader::loadInstancedVariant(MaterialLoader::depthMaterialID,Material("depth","_instanced"));
 }
 void loadSpecificWorld()
 {
@@ -1544,7 +3062,7 @@ void loadSpecificWorld()
     {
         for (size_t j = 1; j < 4; j++)
         {
-            cube2.transformMatrix = glm::translate(mat4(cube.transformMatrix),vec3(2.2 * i,2.2 * j,0.0));
+            cube2.setTransform(Transform(vec3(2.2 * i,2.2 * j,0.0)));
             ModelLoader::loadModel(cube2);
         }
     }
@@ -1558,11 +3076,12 @@ void loadSpecificWorld()
     {
 
         vec3 lightPosition(rand() % 10 - 5,rand() % 10 - 5,rand() % 10 - 5);
-        cube3.transformMatrix = glm::scale(glm::translate(mat4(1.0),lightPosition),vec3(0.1));
+        cube3.setTransform(Transform(lightPosition,quat(1.0f,0.0f,0.0f,0.0f),vec3(0.1)));
         cube3.materialID = 3;
         vec4 color((rand() % 255) / 255.0f,(rand() % 255) / 255.0f,(rand() % 255 ) / 255.0f,1.0);
-        MaterialInstance unshadedColor(1);
-        unshadedColor.set(0,color);
+        const Material& unshaded = MaterialLoader::materials[cube3.materialID];
+        MaterialInstance unshadedColor = unshaded.makeInstance();
+        unshadedColor.set(unshaded.slot("shadecolor"),color);
         cube3.materialInstanceID = MaterialInstanceLoader::loadMaterialInstance(unshadedColor);
         
         ModelLoader::loadModel(cube3);
@@ -1570,10 +3089,159 @@ void loadSpecificWorld()
     }
 }
 
+/*
+ * Light benchmark, a floor of clustered shaded cubes under lightCount small point lights
+ */
+void loadLightBenchmarkWorld(size_t lightCount)
+{
+    MeshID cubeMesh = MeshLoader::loadMesh(MeshLoader::createPrimitiveMesh(MeshLoader::Cube,true));
+
+    Model cube(cubeMesh,MaterialLoader::clusteredMaterialID);
+    cube.materialInstanceID = 0;
+    const int side = 32;
+    for (int i = 0; i < side; i++)
+    {
+        for (int j = 0; j < side; j++)
+        {
+            cube.setTransform(Transform(vec3(2.2f * (i - side / 2),-2.0f,2.2f * (j - side / 2))));
+            ModelLoader::loadModel(cube);
+        }
+    }
+
+    for (size_t i = 0; i < lightCount; i++)
+    {
+        vec3 position((rand() % 700) / 10.0f - 35.0f,(rand() % 40) / 10.0f - 1.0f,(rand() % 700) / 10.0f - 35.0f);
+        vec3 color((rand() % 255) / 255.0f,(rand() % 255) / 255.0f,(rand() % 255) / 255.0f);
+        Light::load(position,color * 4.0f,3.0f);
+    }
+}
+
+/*
+ * Draw submission benchmark, count models spread over a few meshes sharing the same material
+ */
+void loadDrawBenchmarkWorld(size_t count)
+{
+    MeshID meshes[] = {
+        MeshLoader::loadMesh(MeshLoader::createPrimitiveMesh(MeshLoader::Cube,true)),
+        MeshLoader::loadMesh(MeshLoader::createPrimitiveMesh(MeshLoader::Plain,true)),
+        MeshLoader::loadMesh(MeshLoader::createPrimitiveMesh(MeshLoader::Triangle,true))
+    };
+
+    int side = std::max(1,int(std::cbrt(float(count))));
+    for (size_t i = 0; i < count; i++)
+    {
+        Model model(meshes[rand() % 3],2);
+        model.materialInstanceID = 0;
+        vec3 position(int(i) % side,int(i) / side % side,int(i) / (side * side));
+        model.setTransform(Transform((position - vec3(side * 0.5f)) * 0.4f,quat(1.0f,0.0f,0.0f,0.0f),vec3(0.1f)));
+        ModelLoader::loadModel(model);
+    }
+    Light::load(vec3(0.0,4.0,4.0),vec3(1.0));
+}
+
+/*
+ * Material benchmark, count lit cubes each with its own material instance, every instance a different combination
+ * of the diffuse, specular and normal maps available
+ */
+void loadMaterialBenchmarkWorld(size_t count)
+{
+    const char* maps[] = {"floor_base.jpg","floor_specular.jpg","floor_normal.jpg","ice_base.jpg","ice_normal.jpg",
+                          "metal_base.jpg","metal_specular.jpg","metal_normal.jpg","floor_emission.jpg"};
+    const size_t mapCount = sizeof(maps) / sizeof(maps[0]);
+    TextureID textures[mapCount];
+    for (size_t i = 0; i < mapCount; i++) textures[i] = Texture::loadTexture(TextureData(maps[i]));
+
+    MeshID cubeMesh = MeshLoader::loadMesh(MeshLoader::createPrimitiveMesh(MeshLoader::Cube,true));
+    int side = std::max(1,int(std::sqrt(float(count))));
+    for (size_t i = 0; i < count; i++)
+    {
+        // Distinct digits in base mapCount, up to mapCount^3 different materials
+        MaterialInstance instance({Uniform(1.0f + i % 8)});
+        for (int t = 0, digits = i; t < 3; t++, digits /= mapCount) instance.setTexture(textures[(digits + t) % mapCount],t);
+
+        Model cube(cubeMesh,2);
+        cube.materialInstanceID = MaterialInstanceLoader::loadMaterialInstance(instance);
+        cube.setTransform(Transform(vec3(2.2f * (int(i) % side - side / 2),-2.0f,2.2f * (int(i) / side - side / 2))));
+        ModelLoader::loadModel(cube);
+    }
+    Light::load(vec3(0.0,4.0,4.0),vec3(1.0));
+}
+
+/*
+ * Overdraw benchmark, count clustered shaded cubes in a cube shaped grid around the focus, many layers deep from
+ * any side so most pixels are covered several times
+ */
+void loadOverdrawBenchmarkWorld(size_t count)
+{
+    MeshID cubeMesh = MeshLoader::loadMesh(MeshLoader::createPrimitiveMesh(MeshLoader::Cube,true));
+
+    Model cube(cubeMesh,MaterialLoader::clusteredMaterialID);
+    cube.materialInstanceID = 0;
+    int side = std::max(1,int(std::cbrt(float(count))));
+    for (size_t i = 0; i < count; i++)
+    {
+        vec3 position(int(i) % side,int(i) / side % side,int(i) / (side * side));
+        cube.setTransform(Transform((position - vec3(side * 0.5f)) * 2.5f));
+        ModelLoader::loadModel(cube);
+    }
+
+    for (size_t i = 0; i < 64; i++)
+    {
+        vec3 position = vec3((rand() % 200) / 100.0f - 1.0f,(rand() % 200) / 100.0f - 1.0f,(rand() % 200) / 100.0f - 1.0f) * (side * 1.25f);
+        vec3 color((rand() % 255) / 255.0f,(rand() % 255) / 255.0f,(rand() % 255) / 255.0f);
+        Light::load(position,color * 4.0f,4.0f);
+    }
+}
 
 int main(int argc, char** argv)
 {
-    Window *window = createWindow();
+    /*
+     * --bench-lights [count], --bench-draws [count], --bench-materials [count] and --bench-overdraw [count] render a
+     * fixed number of frames of a benchmark scene in a hidden window, --no-mdi keeps the GL 3.3 submission path even when multi draw indirect is
+     * available, --texture-arrays packs the image textures into texture arrays and --bake-static freezes the loaded
+     * world and merges it into static chunks. --front-to-back orders opaque draws by depth bucket and draws the skybox
+     * last, --overdraw shows how many times every pixel is shaded instead of the scene. --depth-prepass lays down depth
+     * before shading, --depth-prepass auto only while the measured overdraw is high enough
+     */
+    string benchmark;
+    size_t benchmarkCount = 0;
+    bool allowMultiDraw = true;
+    bool bakeStatic = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--no-mdi") allowMultiDraw = false;
+        else if (arg == "--texture-arrays") Texture::textureArrays = true;
+        else if (arg == "--bake-static") bakeStatic = true;
+        else if (arg == "--front-to-back") Renderer::frontToBack = true;
+        else if (arg == "--overdraw") Renderer::overdraw = true;
+        else if (arg == "--depth-prepass")
+        {
+            Renderer::depthPrepassMode = Renderer::PREPASS_ON;
+            if (i + 1 < argc && string(argv[i + 1]) == "auto") Renderer::depthPrepassMode = Renderer::PREPASS_AUTO, i++;
+        }
+        else if (arg == "--bench-lights" || arg == "--bench-draws" || arg == "--bench-materials" || arg == "--bench-overdraw")
+        {
+            benchmark = arg;
+            if (i + 1 < argc && isdigit(argv[i + 1][0])) benchmarkCount = stoul(argv[++i]);
+        }
+    }
+
+    Window *window = createWindow(benchmark.empty());
+    if (!window) return 1;
+
+    GLint major,minor;
+    glGetIntegerv(GL_MAJOR_VERSION,&major);
+    glGetIntegerv(GL_MINOR_VERSION,&minor);
+    Renderer::multiDraw = allowMultiDraw && (major > 4 || (major == 4 && minor >= 3));
+    Renderer::objectRing.enabled = major > 4 || (major == 4 && minor >= 4);
+    if (Renderer::objectRing.enabled) Material::shaderDefines += "#define OBJECT_BUFFER\n";
+    if (Texture::textureArrays) Material::shaderDefines += "#define TEXTURE_ARRAYS\n";
+
+    int width,height;
+    glfwGetFramebufferSize(window,&width,&height);
+    Viewport::screenWidth = width;
+    Viewport::screenHeight = height;
     
     glfwSetCursorPosCallback(window, Viewport::cursor_position_callback);
     glfwSetFramebufferSizeCallback(window, Viewport::framebuffer_size_callback);
@@ -1584,9 +3252,19 @@ int main(int argc, char** argv)
     glEnable(GL_DEBUG_OUTPUT);
     #endif
     loadSpecificMaterials();
-    loadSpecificWorld();
+    if (benchmark == "--bench-lights") loadLightBenchmarkWorld(benchmarkCount ? benchmarkCount : 1024);
+    else if (benchmark == "--bench-draws") loadDrawBenchmarkWorld(benchmarkCount ? benchmarkCount : 10000);
+    else if (benchmark == "--bench-materials") loadMaterialBenchmarkWorld(benchmarkCount ? benchmarkCount : 200);
+    else if (benchmark == "--bench-overdraw") loadOverdrawBenchmarkWorld(benchmarkCount ? benchmarkCount : 4096);
+    else loadSpecificWorld();
+    if (Texture::textureArrays) Texture::packTextureArrays();
+    if (bakeStatic)
+    {
+        for (Model& model : ModelLoader::models) model.isStatic = true;
+        ModelLoader::bakeStatic();
+    }
     
     CameraLoader::load(Camera());
     Renderer::Ui::setup_ui(window);
-    return Renderer::render_loop(window);
+    return Renderer::render_loop(window,benchmark.empty() ? 0 : 300);
 }
@@ -0,0 +1,73 @@
+#version 330
+
+#include "textures.glsl"   //Diffuse, specular and normal maps
+uniform samplerCube skybox; //SkyBox 
+
+layout(std140) uniform MaterialBlock
+{
+    float shinness;
+};
+
+in vec3 fragColor;
+in vec4 fragPosition;
+in vec2 texCoord;
+in vec3 normalCoord;
+in mat3 TBN;
+
+#include "scene.glsl"
+
+uniform samplerBuffer lightData;        //Two texels per light: position radius, color
+uniform usamplerBuffer clusterRanges;   //Offset and count per cluster
+uniform usamplerBuffer clusterIndices;  //Light indexs of every cluster, back to back
+
+const float uv_scale = 0.2;
+
+out vec4 color;
+
+int clusterIndex()
+{
+    float depth = -(viewMatrix * fragPosition).z;
+    int slice = clamp(int(log(depth) * clusterDepth.x + clusterDepth.y),0,clusterGrid.z - 1);
+    ivec2 tile = clamp(ivec2(gl_FragCoord.xy / clusterDepth.zw * vec2(clusterGrid.xy)),ivec2(0),clusterGrid.xy - 1);
+    return (slice * clusterGrid.y + tile.y) * clusterGrid.x + tile.x;
+}
+
+void main()
+{
+    vec3 normalValue = materialTexture2(texCoord * uv_scale).xyz;
+    normalValue = normalize(TBN * (normalValue * 2.0 - 1.0));
+    
+    vec3 diffuseValue = materialTexture0(texCoord * uv_scale).xyz;
+    vec3 specularValue = materialTexture1(texCoord * uv_scale).xyz;
+        
+    vec3 viewDir = normalize(viewPos - fragPosition.xyz);
+    vec3 R = reflect(-viewDir,normalValue);
+
+    vec3 v = vec3(0.0);
+    v += texture(skybox, R).rgb * (specularValue * 0.7);
+
+    uvec2 range = texelFetch(clusterRanges,clusterIndex()).xy;
+    for (uint i = 0u; i < range.y; i++)
+    {
+        int light = int(texelFetch(clusterIndices,int(range.x + i)).x);
+        vec4 positionRadius = texelFetch(lightData,light * 2);
+        vec3 lightColor = texelFetch(lightData,light * 2 + 1).rgb;
+
+        vec3 toLight = positionRadius.xyz - fragPosition.xyz;
+        float distance = length(toLight);
+        float falloff = clamp(1.0 - pow(distance / positionRadius.w,4.0),0.0,1.0);
+        float attenuation = falloff * falloff / (distance * distance + 1.0);
+
+        vec3 lightDir = toLight / distance;
+        vec3 reflectDir = reflect(-lightDir,normalValue);
+    
+        float diff = max(dot(normalValue,lightDir),0.0);
+        float spec = pow(max(dot(viewDir, reflectDir), 0.0),32);
+    
+        vec3 diffuse =  (diff + 0.1) * diffuseValue;
+        vec3 specular = (spec * shinness + 0.05) * specularValue;
+    
+        v += (diffuse + specular) * lightColor * attenuation;
+    }
+    color = vec4(v,1.0);
+}
@@ -0,0 +1,29 @@
+
+#version 330
+in vec3 aVertex;
+in vec3 aColor;
+in vec2 aUv;
+in vec3 aNormal;
+in vec3 aTangent;
+
+#include "scene.glsl"
+#include "object.glsl"
+
+out vec3 fragColor;
+out vec4 fragPosition;
+out vec2 texCoord;
+out vec3 normalCoord;
+out mat3 TBN;
+void main()
+{
+    mat4 model = objectTransform();
+    fragPosition = model * vec4(aVertex,1.0);
+    gl_Position = clipPosition(fragPosition);
+    fragColor = aColor;
+    texCoord = aUv;
+    normalCoord = objectNormal() * aNormal;
+    vec3 T = normalize(vec3(model * vec4(aTangent,   0.0)));
+    vec3 N = normalize(vec3(model * vec4(aNormal,    0.0)));
+    vec3 B = normalize(cross(N,T));
+    TBN = mat3(T, B, N);
+}
@@ -3,11 +3,11 @@
 in vec3 aPos;
 out vec3 TexCoords;
 
-uniform mat4 projectionMatrix;
-uniform mat4 viewMatrix;
+#include "scene.glsl"
 
 void main()
 {
     TexCoords = aPos;
-    gl_Position = projectionMatrix * viewMatrix * vec4(aPos, 1.0);
+    vec4 position = projectionMatrix * mat4(mat3(viewMatrix)) * vec4(aPos, 1.0);    // Rotation only, the sky follows the camera
+    gl_Position = position.xyww;                                                     // On the far plane, drawn with LEQUAL
 }  
\ No newline at end of file
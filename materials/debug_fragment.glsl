@@ -4,9 +4,15 @@ in vec3 fragColor;
 in vec2 texCord;
 in vec3 normalCord;
 
-uniform sampler2D texture0;
+#include "textures.glsl"
+
+layout(std140) uniform MaterialBlock
+{
+    float overdraw;         //Added by every shaded fragment when counting overdraw, 0 shows the textured normals
+};
 
 void main()
 {
-    color = texture(texture0,texCord) * vec4(abs(normalCord),1.0);
+    if (overdraw > 0.0) color = vec4(overdraw);
+    else color = materialTexture0(texCord) * vec4(abs(normalCord),1.0);
 }
\ No newline at end of file
@@ -0,0 +1,13 @@
+#version 330
+layout(location = 0) in vec3 aVertex;
+
+// Per instance, see Renderer::InstanceData
+layout(location = 5) in mat4 iTransformMatrix;
+
+#include "scene.glsl"
+#include "object.glsl"
+
+void main()
+{
+    gl_Position = clipPosition(iTransformMatrix * vec4(aVertex,1.0));
+}
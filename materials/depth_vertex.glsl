@@ -0,0 +1,10 @@
+#version 330
+layout(location = 0) in vec3 aVertex;
+
+#include "scene.glsl"
+#include "object.glsl"
+
+void main()
+{
+    gl_Position = clipPosition(objectTransform() * vec4(aVertex,1.0));
+}
@@ -1,9 +1,12 @@
 #version 330
 out vec3 color;
 in vec3 fragColor;
-uniform float time;
-uniform vec3 emissive;
-uniform float factor;
+#include "scene.glsl"
+layout(std140) uniform MaterialBlock
+{
+    vec3 emissive;
+    float factor;
+};
 
 void main()
 {
@@ -1,13 +1,14 @@
 #version 330
 
-const int maxLights = 6;
+#include "scene.glsl"
 
-uniform sampler2D texture0;   //Diffuse map
-uniform sampler2D texture1;   //Specular map
-uniform sampler2D texture2;   //Normal map
+#include "textures.glsl"   //Diffuse, specular and normal maps
 uniform samplerCube skybox; //SkyBox 
 
-uniform float shinness;
+layout(std140) uniform MaterialBlock
+{
+    float shinness;
+};
 
 in vec3 fragColor;
 in vec4 fragPosition;
@@ -15,23 +16,17 @@ in vec2 texCoord;
 in vec3 normalCoord;
 in mat3 TBN;
 
-uniform float time;
-uniform vec3 lightPosition[maxLights];
-uniform vec3 lightColor[maxLights];
-uniform int lightCount;
-uniform vec3 viewPos;
-
 const float uv_scale = 0.2;
 
 out vec4 color;
 
 void main()
 {
-    vec3 normalValue = texture(texture2,texCoord * uv_scale).xyz;
+    vec3 normalValue = materialTexture2(texCoord * uv_scale).xyz;
     normalValue = normalize(TBN * (normalValue * 2.0 - 1.0));
     
-    vec3 diffuseValue = texture(texture0,texCoord * uv_scale).xyz;
-    vec3 specularValue = texture(texture1,texCoord * uv_scale).xyz;
+    vec3 diffuseValue = materialTexture0(texCoord * uv_scale).xyz;
+    vec3 specularValue = materialTexture1(texCoord * uv_scale).xyz;
         
     vec3 viewDir = normalize(viewPos - fragPosition.xyz);
     vec3 R = reflect(-viewDir,normalValue);
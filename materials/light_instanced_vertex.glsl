@@ -0,0 +1,31 @@
+#version 330
+layout(location = 0) in vec3 aVertex;
+layout(location = 1) in vec3 aColor;
+layout(location = 2) in vec2 aUv;
+layout(location = 3) in vec3 aNormal;
+layout(location = 4) in vec3 aTangent;
+
+// Per instance, see Renderer::InstanceData
+layout(location = 5) in mat4 iTransformMatrix;
+layout(location = 9) in mat3 iNormalMatrix;
+
+#include "scene.glsl"
+#include "object.glsl"
+
+out vec3 fragColor;
+out vec4 fragPosition;
+out vec2 texCoord;
+out vec3 normalCoord;
+out mat3 TBN;
+void main()
+{
+    fragPosition = iTransformMatrix * vec4(aVertex,1.0);
+    gl_Position = clipPosition(fragPosition);
+    fragColor = aColor;
+    texCoord = aUv;
+    normalCoord = iNormalMatrix * aNormal;
+    vec3 T = normalize(vec3(iTransformMatrix * vec4(aTangent,   0.0)));
+    vec3 N = normalize(vec3(iTransformMatrix * vec4(aNormal,    0.0)));
+    vec3 B = normalize(cross(N,T));
+    TBN = mat3(T, B, N);
+}
@@ -6,10 +6,8 @@ in vec2 aUv;
 in vec3 aNormal;
 in vec3 aTangent;
 
-uniform mat4 projectionMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 transformMatrix;
-uniform mat3 normalMatrix;
+#include "scene.glsl"
+#include "object.glsl"
 
 out vec3 fragColor;
 out vec4 fragPosition;
@@ -18,13 +16,14 @@ out vec3 normalCoord;
 out mat3 TBN;
 void main()
 {
-    fragPosition = transformMatrix * vec4(aVertex,1.0);
-    gl_Position = projectionMatrix * viewMatrix * fragPosition;
+    mat4 model = objectTransform();
+    fragPosition = model * vec4(aVertex,1.0);
+    gl_Position = clipPosition(fragPosition);
     fragColor = aColor;
     texCoord = aUv;
-    normalCoord = normalMatrix * aNormal;
-    vec3 T = normalize(vec3(transformMatrix * vec4(aTangent,   0.0)));
-    vec3 N = normalize(vec3(transformMatrix * vec4(aNormal,    0.0)));
+    normalCoord = objectNormal() * aNormal;
+    vec3 T = normalize(vec3(model * vec4(aTangent,   0.0)));
+    vec3 N = normalize(vec3(model * vec4(aNormal,    0.0)));
     vec3 B = normalize(cross(N,T));
     TBN = mat3(T, B, N);
 }
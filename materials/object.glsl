@@ -0,0 +1,33 @@
+// Per object transform, either streamed through the object buffer (GL 4.4) or set as plain uniforms per draw
+// Expects scene.glsl included before it
+
+// The depth pre-pass and the GL_EQUAL main pass must agree on depth to the bit, so every object shader projects here
+invariant gl_Position;
+
+vec4 clipPosition(vec4 worldPosition)
+{
+    return projectionMatrix * viewMatrix * worldPosition;
+}
+
+#ifdef OBJECT_BUFFER
+uniform samplerBuffer objectData;           // 7 texels per object, transform columns then normal matrix columns
+uniform int objectIndex;
+
+mat4 objectTransform()
+{
+    int base = objectIndex * 7;
+    return mat4(texelFetch(objectData,base),texelFetch(objectData,base + 1),texelFetch(objectData,base + 2),texelFetch(objectData,base + 3));
+}
+
+mat3 objectNormal()
+{
+    int base = objectIndex * 7 + 4;
+    return mat3(texelFetch(objectData,base).xyz,texelFetch(objectData,base + 1).xyz,texelFetch(objectData,base + 2).xyz);
+}
+#else
+uniform mat4 transformMatrix;
+uniform mat3 normalMatrix;
+
+mat4 objectTransform() { return transformMatrix; }
+mat3 objectNormal() { return normalMatrix; }
+#endif
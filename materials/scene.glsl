@@ -0,0 +1,15 @@
+// Per frame scene constants shared by every program, std140 mirror of Renderer::SceneBlock
+const int maxLights = 6;
+
+layout(std140) uniform SceneBlock
+{
+    mat4 projectionMatrix;
+    mat4 viewMatrix;
+    vec3 viewPos;
+    float time;
+    vec3 lightPosition[maxLights];
+    vec3 lightColor[maxLights];
+    int lightCount;
+    ivec4 clusterGrid;
+    vec4 clusterDepth;      // xy slice = log(depth) * x + y, zw screen size
+};
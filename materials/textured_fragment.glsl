@@ -3,9 +3,9 @@ out vec4 color;
 in vec3 fragColor;
 in vec2 texCord;
 
-uniform sampler2D texture0;
+#include "textures.glsl"
 
 void main()
 {
-    color = texture(texture0,texCord) * vec4(fragColor,1.0);
+    color = materialTexture0(texCord) * vec4(fragColor,1.0);
 }
\ No newline at end of file
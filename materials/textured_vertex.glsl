@@ -4,16 +4,16 @@ in vec3 vertex;
 in vec3 color;
 in vec2 uv;
 
-uniform mat4 projectionMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 transformMatrix;
+#include "scene.glsl"
+#include "object.glsl"
 
 out vec3 fragColor;
 out vec2 texCord;
 
 void main()
 {
-    gl_Position = projectionMatrix * viewMatrix * transformMatrix * vec4(vertex,1.0);
+    mat4 model = objectTransform();
+    gl_Position = clipPosition(model * vec4(vertex,1.0));
     fragColor = color;
     texCord = uv;
 }
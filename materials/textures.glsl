@@ -0,0 +1,23 @@
+// Material textures texture0 to texture3, either one 2D texture per unit or a layer of a packed texture array
+#ifdef TEXTURE_ARRAYS
+uniform sampler2DArray texture0;
+uniform sampler2DArray texture1;
+uniform sampler2DArray texture2;
+uniform sampler2DArray texture3;
+uniform ivec4 textureLayers;                // Layer of every texture in the array bound on its unit
+
+vec4 materialTexture0(vec2 uv) { return texture(texture0,vec3(uv,textureLayers.x)); }
+vec4 materialTexture1(vec2 uv) { return texture(texture1,vec3(uv,textureLayers.y)); }
+vec4 materialTexture2(vec2 uv) { return texture(texture2,vec3(uv,textureLayers.z)); }
+vec4 materialTexture3(vec2 uv) { return texture(texture3,vec3(uv,textureLayers.w)); }
+#else
+uniform sampler2D texture0;
+uniform sampler2D texture1;
+uniform sampler2D texture2;
+uniform sampler2D texture3;
+
+vec4 materialTexture0(vec2 uv) { return texture(texture0,uv); }
+vec4 materialTexture1(vec2 uv) { return texture(texture1,uv); }
+vec4 materialTexture2(vec2 uv) { return texture(texture2,uv); }
+vec4 materialTexture3(vec2 uv) { return texture(texture3,uv); }
+#endif
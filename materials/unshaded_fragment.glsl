@@ -1,6 +1,9 @@
 #version 330
 out vec4 color;
-uniform vec4 shadecolor;
+layout(std140) uniform MaterialBlock
+{
+    vec4 shadecolor;
+};
 void main()
 {
     color = shadecolor;
@@ -2,11 +2,11 @@
 #version 330
 in vec3 vertex;
 
-uniform mat4 projectionMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 transformMatrix;
+#include "scene.glsl"
+#include "object.glsl"
 
 void main()
 {
-    gl_Position = projectionMatrix * viewMatrix * transformMatrix * vec4(vertex,1.0);
+    mat4 model = objectTransform();
+    gl_Position = clipPosition(model * vec4(vertex,1.0));
 }
@@ -0,0 +1,202 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <algorithm>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+/*
+ * Batched matrix kernels. Reference holds the scalar glm path, the AVX kernels are used whenever the build enables them
+ * (see the main target in the Makefile), the debug build falls back to the reference path.
+ */
+namespace MatrixKernels
+{
+    const static size_t noParent = -1;
+
+    namespace Reference
+    {
+        inline void multiply(const glm::mat4* a,const glm::mat4* b,glm::mat4* out,size_t count)
+        {
+            for (size_t i = 0; i < count; i++) out[i] = a[i] * b[i];
+        }
+
+        inline void multiplyParented(glm::mat4* combined,const glm::mat4* transforms,const size_t* parents,size_t begin,size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+                combined[i] = parents[i] == noParent ? transforms[i] : combined[parents[i]] * transforms[i];
+        }
+
+        inline void inverse(const glm::mat4* in,glm::mat4* out,size_t count)
+        {
+            for (size_t i = 0; i < count; i++) out[i] = glm::inverse(in[i]);
+        }
+
+        inline void normalMatrices(const glm::mat4* in,glm::mat3* out,size_t count)
+        {
+            for (size_t i = 0; i < count; i++) out[i] = glm::transpose(glm::inverse(in[i]));
+        }
+    }
+
+#ifdef __AVX__
+    namespace Avx
+    {
+        const static size_t lanes = 8;
+
+        inline __m256 broadcastColumn(const float* column)
+        {
+            __m128 c = _mm_loadu_ps(column);
+            return _mm256_insertf128_ps(_mm256_castps128_ps256(c),c,1);
+        }
+
+        // out = a * b, two result columns per 256 bit register. Both inputs are read before out is written
+        inline void multiply(const float* a,const float* b,float* out)
+        {
+            __m256 a0 = broadcastColumn(a);
+            __m256 a1 = broadcastColumn(a + 4);
+            __m256 a2 = broadcastColumn(a + 8);
+            __m256 a3 = broadcastColumn(a + 12);
+
+            for (int j = 0; j < 16; j += 8)
+            {
+                __m256 bj = _mm256_loadu_ps(b + j);
+                __m256 r = _mm256_mul_ps(a0,_mm256_permute_ps(bj,0x00));
+                r = _mm256_add_ps(r,_mm256_mul_ps(a1,_mm256_permute_ps(bj,0x55)));
+                r = _mm256_add_ps(r,_mm256_mul_ps(a2,_mm256_permute_ps(bj,0xAA)));
+                r = _mm256_add_ps(r,_mm256_mul_ps(a3,_mm256_permute_ps(bj,0xFF)));
+                _mm256_storeu_ps(out + j,r);
+            }
+        }
+
+        // Transposes up to 8 matrices into structure of arrays form, missing lanes are filled with identity
+        template <int N>
+        inline void loadLanes(const float* in,size_t stride,size_t count,__m256* soa)
+        {
+            alignas(32) float buffer[N][lanes];
+            for (size_t l = 0; l < lanes; l++)
+                for (int k = 0; k < N; k++)
+                    buffer[k][l] = l < count ? in[l * stride + k] : float(k % 5 == 0);
+            for (int k = 0; k < N; k++) soa[k] = _mm256_load_ps(buffer[k]);
+        }
+
+        template <int N>
+        inline void storeLanes(const __m256* soa,size_t stride,size_t count,float* out)
+        {
+            alignas(32) float buffer[N][lanes];
+            for (int k = 0; k < N; k++) _mm256_store_ps(buffer[k],soa[k]);
+            for (size_t l = 0; l < count; l++)
+                for (int k = 0; k < N; k++)
+                    out[l * stride + k] = buffer[k][l];
+        }
+
+        // Inverse of 8 matrices at once through 2x2 sub determinants (Laplace expansion)
+        inline void inverse8(const __m256* m,__m256* r)
+        {
+            #define A(i,j) m[(i) * 4 + (j)]
+            __m256 s0 = A(0,0) * A(1,1) - A(1,0) * A(0,1);
+            __m256 s1 = A(0,0) * A(1,2) - A(1,0) * A(0,2);
+            __m256 s2 = A(0,0) * A(1,3) - A(1,0) * A(0,3);
+            __m256 s3 = A(0,1) * A(1,2) - A(1,1) * A(0,2);
+            __m256 s4 = A(0,1) * A(1,3) - A(1,1) * A(0,3);
+            __m256 s5 = A(0,2) * A(1,3) - A(1,2) * A(0,3);
+
+            __m256 c5 = A(2,2) * A(3,3) - A(3,2) * A(2,3);
+            __m256 c4 = A(2,1) * A(3,3) - A(3,1) * A(2,3);
+            __m256 c3 = A(2,1) * A(3,2) - A(3,1) * A(2,2);
+            __m256 c2 = A(2,0) * A(3,3) - A(3,0) * A(2,3);
+            __m256 c1 = A(2,0) * A(3,2) - A(3,0) * A(2,2);
+            __m256 c0 = A(2,0) * A(3,1) - A(3,0) * A(2,1);
+
+            __m256 det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+            __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f),det);
+
+            r[0]  = ( A(1,1) * c5 - A(1,2) * c4 + A(1,3) * c3) * invDet;
+            r[1]  = (-A(0,1) * c5 + A(0,2) * c4 - A(0,3) * c3) * invDet;
+            r[2]  = ( A(3,1) * s5 - A(3,2) * s4 + A(3,3) * s3) * invDet;
+            r[3]  = (-A(2,1) * s5 + A(2,2) * s4 - A(2,3) * s3) * invDet;
+            r[4]  = (-A(1,0) * c5 + A(1,2) * c2 - A(1,3) * c1) * invDet;
+            r[5]  = ( A(0,0) * c5 - A(0,2) * c2 + A(0,3) * c1) * invDet;
+            r[6]  = (-A(3,0) * s5 + A(3,2) * s2 - A(3,3) * s1) * invDet;
+            r[7]  = ( A(2,0) * s5 - A(2,2) * s2 + A(2,3) * s1) * invDet;
+            r[8]  = ( A(1,0) * c4 - A(1,1) * c2 + A(1,3) * c0) * invDet;
+            r[9]  = (-A(0,0) * c4 + A(0,1) * c2 - A(0,3) * c0) * invDet;
+            r[10] = ( A(3,0) * s4 - A(3,1) * s2 + A(3,3) * s0) * invDet;
+            r[11] = (-A(2,0) * s4 + A(2,1) * s2 - A(2,3) * s0) * invDet;
+            r[12] = (-A(1,0) * c3 + A(1,1) * c1 - A(1,2) * c0) * invDet;
+            r[13] = ( A(0,0) * c3 - A(0,1) * c1 + A(0,2) * c0) * invDet;
+            r[14] = (-A(3,0) * s3 + A(3,1) * s1 - A(3,2) * s0) * invDet;
+            r[15] = ( A(2,0) * s3 - A(2,1) * s1 + A(2,2) * s0) * invDet;
+            #undef A
+        }
+
+        // transpose(inverse(mat3(m))) for 8 matrices, its columns are the cross products of the columns of m over the determinant
+        inline void normal8(const __m256* m,__m256* r)
+        {
+            #define A(c,i) m[(c) * 4 + (i)]
+            __m256 x0 = A(1,1) * A(2,2) - A(1,2) * A(2,1);
+            __m256 x1 = A(1,2) * A(2,0) - A(1,0) * A(2,2);
+            __m256 x2 = A(1,0) * A(2,1) - A(1,1) * A(2,0);
+
+            __m256 det = A(0,0) * x0 + A(0,1) * x1 + A(0,2) * x2;
+            __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f),det);
+
+            r[0] = x0 * invDet;
+            r[1] = x1 * invDet;
+            r[2] = x2 * invDet;
+            r[3] = (A(2,1) * A(0,2) - A(2,2) * A(0,1)) * invDet;
+            r[4] = (A(2,2) * A(0,0) - A(2,0) * A(0,2)) * invDet;
+            r[5] = (A(2,0) * A(0,1) - A(2,1) * A(0,0)) * invDet;
+            r[6] = (A(0,1) * A(1,2) - A(0,2) * A(1,1)) * invDet;
+            r[7] = (A(0,2) * A(1,0) - A(0,0) * A(1,2)) * invDet;
+            r[8] = (A(0,0) * A(1,1) - A(0,1) * A(1,0)) * invDet;
+            #undef A
+        }
+    }
+
+    inline void multiply(const glm::mat4* a,const glm::mat4* b,glm::mat4* out,size_t count)
+    {
+        for (size_t i = 0; i < count; i++) Avx::multiply(&a[i][0][0],&b[i][0][0],&out[i][0][0]);
+    }
+
+    /*
+     * Propagates world matrices over [begin,end), parents must be stored before their children
+     */
+    inline void multiplyParented(glm::mat4* combined,const glm::mat4* transforms,const size_t* parents,size_t begin,size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            if (parents[i] == noParent) combined[i] = transforms[i];
+            else Avx::multiply(&combined[parents[i]][0][0],&transforms[i][0][0],&combined[i][0][0]);
+        }
+    }
+
+    inline void inverse(const glm::mat4* in,glm::mat4* out,size_t count)
+    {
+        __m256 m[16],r[16];
+        for (size_t i = 0; i < count; i += Avx::lanes)
+        {
+            size_t n = std::min(count - i,Avx::lanes);
+            Avx::loadLanes<16>(&in[i][0][0],16,n,m);
+            Avx::inverse8(m,r);
+            Avx::storeLanes<16>(r,16,n,&out[i][0][0]);
+        }
+    }
+
+    inline void normalMatrices(const glm::mat4* in,glm::mat3* out,size_t count)
+    {
+        __m256 m[16],r[9];
+        for (size_t i = 0; i < count; i += Avx::lanes)
+        {
+            size_t n = std::min(count - i,Avx::lanes);
+            Avx::loadLanes<16>(&in[i][0][0],16,n,m);
+            Avx::normal8(m,r);
+            Avx::storeLanes<9>(r,9,n,&out[i][0][0]);
+        }
+    }
+#else
+    using Reference::multiply;
+    using Reference::multiplyParented;
+    using Reference::inverse;
+    using Reference::normalMatrices;
+#endif
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Per frame draw order. Every queued draw gets a 64 bit key, most significant bits first:
+ *
+ *   material (12) | material instance (18) | mesh (18) | quantized depth (16)
+ *
+ * so sorting the keys groups the draws by state and orders each group by depth. Front to back keys put a coarse
+ * depth bucket above the state instead, so opaque draws go roughly front to back and only change state within a bucket:
+ *
+ *   depth bucket (4) | material (12) | material instance (18) | mesh (18) | quantized depth (12)
+ *
+ * Depth only breaks ties between draws of the same state, so it gives up the bits. Ids past their field, 4095
+ * materials or 262143 instances or meshes, saturate and sort as one, see saturates.
+ *
+ * The queue is rebuilt every frame and sorted with an LSD radix sort, 8 bits per pass, passes where every key shares
+ * the same byte are skipped.
+ */
+struct RenderQueue
+{
+    struct Entry
+    {
+        uint64_t key;
+        uint32_t index;
+    };
+
+    const static int materialBits = 12, instanceBits = 18, meshBits = 18, depthBits = 16;
+    const static int bucketBits = 4, bucketDepthBits = 12;
+    const static size_t parallelThreshold = 1 << 14;
+
+    std::vector<Entry> entries;
+    std::vector<Entry> scratch;
+    std::vector<size_t> histograms;     // 256 counters per thread
+    float depthRange;
+
+    RenderQueue(float _depthRange = 500.0f) : depthRange(_depthRange) { }
+
+    inline size_t size() const { return entries.size(); }
+    inline void clear() { entries.clear(); }
+    inline uint32_t operator[](size_t i) const { return entries[i].index; }
+
+    // Ids that don't fit in their field (like a missing instance, -1) saturate to the last value
+    inline static uint64_t field(size_t value,int bits)
+    {
+        return std::min<uint64_t>(value,(uint64_t(1) << bits) - 1);
+    }
+
+    // True if a real id reaches the last value of its field and would sort together with others, a missing instance doesn't count
+    inline static bool saturates(size_t material,size_t instance,size_t mesh)
+    {
+        return material >= (size_t(1) << materialBits) - 1 || mesh >= (size_t(1) << meshBits) - 1 ||
+               (instance != size_t(-1) && instance >= (size_t(1) << instanceBits) - 1);
+    }
+
+    inline uint64_t makeKey(size_t material,size_t instance,size_t mesh,float depth) const
+    {
+        float normalized = std::min(std::max(depth / depthRange,0.0f),1.0f);
+        uint64_t quantized = uint64_t(normalized * float((1 << depthBits) - 1));
+        return field(material,materialBits) << (instanceBits + meshBits + depthBits) |
+               field(instance,instanceBits) << (meshBits + depthBits) |
+               field(mesh,meshBits) << depthBits |
+               quantized;
+    }
+
+    // Buckets grow with depth, log2(1 + depth) spaced, near geometry is split finer where most of the overdraw is
+    inline uint64_t makeFrontToBackKey(size_t material,size_t instance,size_t mesh,float depth) const
+    {
+        float normalized = std::min(std::max(depth / depthRange,0.0f),1.0f);
+        float logDepth = std::log2(1.0f + std::max(depth,0.0f)) / std::log2(1.0f + depthRange);
+        uint64_t bucket = std::min<uint64_t>(uint64_t(logDepth * float(1 << bucketBits)),(1 << bucketBits) - 1);
+        uint64_t quantized = uint64_t(normalized * float((1 << bucketDepthBits) - 1));
+        return bucket << (materialBits + instanceBits + meshBits + bucketDepthBits) |
+               field(material,materialBits) << (instanceBits + meshBits + bucketDepthBits) |
+               field(instance,instanceBits) << (meshBits + bucketDepthBits) |
+               field(mesh,meshBits) << bucketDepthBits |
+               quantized;
+    }
+
+    inline void push(uint64_t key,uint32_t index) { entries.push_back({key,index}); }
+
+    void sort()
+    {
+        size_t count = entries.size();
+        scratch.resize(count);
+
+        int threads = 1;
+        #ifdef _OPENMP
+        if (count >= parallelThreshold) threads = omp_get_max_threads();
+        #endif
+        histograms.assign(size_t(threads) * 256,0);
+
+        for (int shift = 0; shift < 64; shift += 8)
+        {
+            if (radixPass(shift,threads)) entries.swap(scratch);
+        }
+    }
+
+    private:
+
+    inline static size_t chunkBegin(size_t count,int threads,int t) { return count * t / threads; }
+
+    /*
+     * Stable scatter of entries into scratch by one byte of the key. Each thread counts its own chunk, the offsets are
+     * laid out bucket major then thread so the relative order of equal bytes is kept. Returns false if the pass was skipped
+     */
+    bool radixPass(int shift,int threads)
+    {
+        size_t count = entries.size();
+        std::fill(histograms.begin(),histograms.end(),0);
+
+        #pragma omp parallel for num_threads(threads) schedule(static,1) if (threads > 1)
+        for (int t = 0; t < threads; t++)
+        {
+            size_t* histogram = &histograms[size_t(t) * 256];
+            for (size_t i = chunkBegin(count,threads,t); i < chunkBegin(count,threads,t + 1); i++)
+                histogram[(entries[i].key >> shift) & 0xFF]++;
+        }
+
+        size_t offset = 0;
+        for (int bucket = 0; bucket < 256; bucket++)
+        {
+            size_t bucketCount = 0;
+            for (int t = 0; t < threads; t++) bucketCount += histograms[size_t(t) * 256 + bucket];
+            if (bucketCount == count) return false;
+
+            for (int t = 0; t < threads; t++)
+            {
+                size_t& counter = histograms[size_t(t) * 256 + bucket];
+                size_t c = counter;
+                counter = offset;
+                offset += c;
+            }
+        }
+
+        #pragma omp parallel for num_threads(threads) schedule(static,1) if (threads > 1)
+        for (int t = 0; t < threads; t++)
+        {
+            size_t* histogram = &histograms[size_t(t) * 256];
+            for (size_t i = chunkBegin(count,threads,t); i < chunkBegin(count,threads,t + 1); i++)
+                scratch[histogram[(entries[i].key >> shift) & 0xFF]++] = entries[i];
+        }
+        return true;
+    }
+};
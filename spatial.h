@@ -1,56 +1,474 @@
+#pragma once
 #include <glm/glm.hpp>
-#include <list>
+#include <vector>
+#include <algorithm>
+#include "matrix_kernels.h"
+#include "transform.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-struct SpatialNode
+using SpatialID = size_t;
+
+struct SpatialRange
+{
+    size_t begin,end;
+};
+
+/*
+ * Flattened transform hierarchy. Nodes are kept in parallel arrays in depth first order, so every parent
+ * is stored before its children and a whole subtree lives in the contiguous range [index, index + subtreeSize).
+ * World matrices are then resolved with a single linear pass over the arrays.
+ *
+ * SpatialIDs are stable generation checked handles into a slot table, the storage index of a node may change whenever
+ * the hierarchy is reordered. Destroying a node frees its whole subtree, the slots are recycled with a new generation so
+ * stale handles can be detected, and the dead storage is compacted once it grows past a quarter of the arrays. All
+ * buffers are reused, once warmed up creating and destroying nodes does not allocate.
+ *
+ * Nodes created under a parent whose subtree doesn't end at the back of the arrays are appended past the ordered part
+ * instead. They still come after their parent but their subtree ranges are unknown, every update recomputes the whole
+ * appended tail and the hierarchy is reordered once the tail grows past an eighth of the nodes.
+ *
+ * Local transform changes are recorded in a dirty list, update() only recomputes the subtrees below dirty nodes
+ * so the per frame cost follows what changed and not the size of the scene.
+ *
+ * Big updates are split across OpenMP threads. Disjoint subtrees are independent, so the hierarchy is partitioned
+ * into a serial spine of large ancestors and balanced ranges of whole subtrees that run in parallel. Every node is
+ * computed by the same kernel from the same inputs, so the result is bit identical to the serial pass.
+ */
+struct SpatialHierarchy
 {
-    std::list<SpatialNode*> children;
-    SpatialNode* parent;
+    const static size_t noParent = -1;
+
+    static inline size_t slotOf(SpatialID id) { return id & 0xffffffff; }
+    static inline size_t generationOf(SpatialID id) { return id >> 32; }
+    static inline SpatialID makeID(size_t slot,size_t generation) { return (generation << 32) | slot; }
+
+    std::vector<glm::mat4> transforms;          // index -> local transform
+    std::vector<glm::mat4> combined;            // index -> world transform
+    std::vector<size_t> parents;                // index -> parent index
+    std::vector<size_t> subtreeSizes;           // index -> node count of the subtree, itself included
+    std::vector<SpatialID> ids;                 // index -> SpatialID
+    std::vector<bool> alive;                    // index -> false once destroyed, until the next compaction
+    std::vector<bool> overflowParents;          // index -> has children appended past the ordered part
+
+    std::vector<size_t> indexs;                 // slot -> index
+    std::vector<size_t> generations;            // slot -> generation of the current owner
+    std::vector<bool> dirtyFlags;               // slot -> local transform changed since the last update
+    std::vector<size_t> freeSlots;
+
+    std::vector<size_t> dirty;                  // slots
+    std::vector<size_t> dirtyIndexs;
+    std::vector<SpatialRange> dirtyRanges;
+
+    std::vector<size_t> spine;                  // nodes computed serially before the parallel ranges
+    std::vector<SpatialRange> partition;        // independent ranges of whole subtrees
+    size_t partitionedCount = 0;
+    int partitionedThreads = 0;
+
+    // Scratch buffers of rebuild(), kept around so reordering doesn't allocate
+    std::vector<size_t> childStart,childList,fill,order,stack,newIndex,scratchParents;
+    std::vector<glm::mat4> scratchTransforms,scratchCombined;
+    std::vector<SpatialID> scratchIds;
+
+    bool ordered = true;
+    size_t orderedEnd = 0;                      // Nodes before it are in depth first order with their subtree sizes
+    size_t deadCount = 0;
+    size_t updatedNodes = 0;                    // world matrices recomputed by the last update
+    size_t parallelThreshold = 1 << 14;         // minimum nodes to update before going parallel
+
+    inline size_t size() const { return transforms.size(); }
+    inline size_t liveCount() const { return size() - deadCount; }
+    inline size_t overflowCount() const { return size() - orderedEnd; }
+
+    /*
+     * Reserves room for count live nodes plus the dead storage allowed before compaction
+     */
+    void reserve(size_t count)
+    {
+        size_t storage = count + count / 3 + 1;
+        transforms.reserve(storage);
+        combined.reserve(storage);
+        parents.reserve(storage);
+        subtreeSizes.reserve(storage);
+        ids.reserve(storage);
+        alive.reserve(storage);
+        overflowParents.reserve(storage);
+        indexs.reserve(storage);
+        generations.reserve(storage);
+        dirtyFlags.reserve(storage);
+        freeSlots.reserve(storage);
+        dirty.reserve(storage);
+        dirtyIndexs.reserve(storage);
+        dirtyRanges.reserve(storage);
+    }
+
+    inline bool isValid(SpatialID id) const
+    {
+        return id != noParent && slotOf(id) < generations.size() && generations[slotOf(id)] == generationOf(id);
+    }
+
+    inline size_t indexOf(SpatialID id) const { return indexs[slotOf(id)]; }
+
+    SpatialID create(glm::mat4 transform,SpatialID parent = noParent)
+    {
+        size_t slot;
+        if (!freeSlots.empty())
+        {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else
+        {
+            slot = indexs.size();
+            indexs.push_back(0);
+            generations.push_back(0);
+            dirtyFlags.push_back(false);
+        }
+
+        SpatialID id = makeID(slot,generations[slot]);
+        size_t index = size();
+        size_t parentIndex = isValid(parent) ? indexOf(parent) : noParent;
+        indexs[slot] = index;
+
+        transforms.push_back(transform);
+        combined.push_back(transform);
+        parents.push_back(parentIndex);
+        subtreeSizes.push_back(1);
+        ids.push_back(id);
+        alive.push_back(true);
+        overflowParents.push_back(false);
+        markDirty(slot);
 
-    glm::mat4 combined;
-    glm::mat4 transform;
+        // Appending keeps the depth first order only if every ancestor's subtree ends right here
+        bool inOrder = orderedEnd == index;
+        for (size_t a = parentIndex; inOrder && a != noParent; a = parents[a])
+            if (a + subtreeSizes[a] != index) inOrder = false;
 
-    size_t cacheFrame = 0;
+        if (inOrder)
+        {
+            for (size_t a = parentIndex; a != noParent; a = parents[a]) subtreeSizes[a]++;
+            orderedEnd++;
+        }
+        else if (parentIndex != noParent) overflowParents[parentIndex] = true;
+        return id;
+    }
+
+    /*
+     * Frees the node and its whole subtree, returns false for stale handles
+     */
+    bool destroy(SpatialID id)
+    {
+        if (!isValid(id)) return false;
+        if (!ordered) rebuild();
+
+        size_t index = indexOf(id);
+        bool overflowChildren = false;
+        for (size_t i = index; i < index + subtreeSizes[index]; i++)
+        {
+            if (!alive[i]) continue;
+            overflowChildren = overflowChildren || overflowParents[i];
+            freeNode(i);
+        }
+
+        // Appended descendants aren't in the range, they come after their parents so one pass finds them all
+        if (overflowChildren)
+        {
+            for (size_t i = std::max(index + 1,orderedEnd); i < size(); i++)
+                if (alive[i] && parents[i] != noParent && !alive[parents[i]]) freeNode(i);
+        }
+
+        // Compacted by the next update
+        if (deadCount * 4 > size()) ordered = false;
+        return true;
+    }
 
-    SpatialNode(SpatialNode* _parent,glm::mat4 _transform) : parent(_parent), transform(_transform) { }
+    inline void freeNode(size_t index)
+    {
+        size_t slot = slotOf(ids[index]);
+        alive[index] = false;
+        generations[slot] = (generations[slot] + 1) & 0xffffffff;
+        freeSlots.push_back(slot);
+        deadCount++;
+    }
 
-    inline glm::mat4 getCombined(size_t _cacheFrame)
+    inline void markDirty(size_t slot)
     {
-        if (cacheFrame) return combined;
-        combined = parent ? parent->getCombined(_cacheFrame) * transform : transform;
-        cacheFrame = _cacheFrame;
-        return combined;
+        if (dirtyFlags[slot]) return;
+        dirtyFlags[slot] = true;
+        dirty.push_back(slot);
     }
 
-    inline void flush()
+    // Moves under parent, moves that would hang a node from itself or one of its descendants are ignored
+    inline void setParent(SpatialID id,SpatialID parent)
     {
-        cacheFrame = 0;
-        for(auto &child : children) child->flush();
+        if (!isValid(id) || (parent != noParent && !isValid(parent))) return;
+
+        size_t parentIndex = parent == noParent ? noParent : indexOf(parent);
+        for (size_t a = parentIndex; a != noParent; a = parents[a])
+            if (a == indexOf(id)) return;
+        if (parents[indexOf(id)] == parentIndex) return;
+        parents[indexOf(id)] = parentIndex;
+        markDirty(slotOf(id));
+        ordered = false;
     }
 
-    inline bool isNew(size_t _cacheFrame) const
+    // Stale handles have no parent and read the identity, setting their transform does nothing
+
+    inline SpatialID getParent(SpatialID id) const
     {
-        return cacheFrame == 0 || cacheFrame == _cacheFrame;
+        if (!isValid(id)) return noParent;
+        size_t parentIndex = parents[indexOf(id)];
+        return parentIndex == noParent ? noParent : ids[parentIndex];
+    }
+
+    inline const glm::mat4& getTransform(SpatialID id) const { return isValid(id) ? transforms[indexOf(id)] : identity(); }
+    inline const glm::mat4& getCombined(SpatialID id) const { return isValid(id) ? combined[indexOf(id)] : identity(); }
+
+    inline void setTransform(SpatialID id,const glm::mat4& transform)
+    {
+        if (!isValid(id)) return;
+        transforms[indexOf(id)] = transform;
+        markDirty(slotOf(id));
+    }
+
+    static inline const glm::mat4& identity()
+    {
+        static const glm::mat4 matrix(1.0f);
+        return matrix;
+    }
+
+    /*
+     * Restores the depth first order after out of order insertions or reparenting and drops destroyed nodes
+     */
+    void rebuild()
+    {
+        size_t count = size();
+
+        // Children adjacency in compressed form, no per node allocations
+        childStart.assign(count + 1,0);
+        childList.resize(count);
+        for (size_t i = 0; i < count; i++)
+            if (alive[i] && parents[i] != noParent) childStart[parents[i] + 1]++;
+        for (size_t i = 0; i < count; i++)
+            childStart[i + 1] += childStart[i];
+
+        fill.assign(childStart.begin(),childStart.end() - 1);
+        for (size_t i = 0; i < count; i++)
+            if (alive[i] && parents[i] != noParent) childList[fill[parents[i]]++] = i;
+
+        order.clear();
+        stack.clear();
+        for (size_t root = 0; root < count; root++)
+        {
+            if (!alive[root] || parents[root] != noParent) continue;
+            stack.push_back(root);
+            while (!stack.empty())
+            {
+                size_t node = stack.back();
+                stack.pop_back();
+                order.push_back(node);
+                for (size_t c = childStart[node + 1]; c > childStart[node]; c--)
+                    stack.push_back(childList[c - 1]);
+            }
+        }
+
+        // Freed slots that are not reused yet must not point into the new arrays
+        for (size_t i = 0; i < count; i++)
+            if (!alive[i] && indexs[slotOf(ids[i])] == i) indexs[slotOf(ids[i])] = noParent;
+
+        size_t liveNodes = order.size();
+        newIndex.resize(count);
+        for (size_t i = 0; i < liveNodes; i++) newIndex[order[i]] = i;
+
+        scratchTransforms.resize(liveNodes);
+        scratchCombined.resize(liveNodes);
+        scratchParents.resize(liveNodes);
+        scratchIds.resize(liveNodes);
+        for (size_t i = 0; i < liveNodes; i++)
+        {
+            size_t old = order[i];
+            scratchTransforms[i] = transforms[old];
+            scratchCombined[i] = combined[old];
+            scratchParents[i] = parents[old] == noParent ? noParent : newIndex[parents[old]];
+            scratchIds[i] = ids[old];
+            indexs[slotOf(ids[old])] = i;
+        }
+        transforms.swap(scratchTransforms);
+        combined.swap(scratchCombined);
+        parents.swap(scratchParents);
+        ids.swap(scratchIds);
+
+        alive.assign(liveNodes,true);
+        overflowParents.assign(liveNodes,false);
+        deadCount = 0;
+        orderedEnd = liveNodes;
+
+        subtreeSizes.assign(liveNodes,1);
+        for (size_t i = liveNodes; i-- > 0;)
+            if (parents[i] != noParent) subtreeSizes[parents[i]] += subtreeSizes[i];
+
+        ordered = true;
+        partitionedCount = 0;
+    }
+
+    inline void clearDirty()
+    {
+        for (size_t slot : dirty) dirtyFlags[slot] = false;
+        dirty.clear();
+    }
+
+    static inline int threadCount()
+    {
+        #ifdef _OPENMP
+        return omp_get_max_threads();
+        #else
+        return 1;
+        #endif
+    }
+
+    /*
+     * Nodes whose subtree exceeds the target chunk go to the spine, the rest is grouped into consecutive
+     * subtrees of up to target nodes. A range never contains an ancestor of another range.
+     */
+    void buildPartition(int threads)
+    {
+        size_t count = size();
+        size_t target = std::max<size_t>(count / (size_t(threads) * 8),1);
+
+        spine.clear();
+        partition.clear();
+        for (size_t i = 0; i < count;)
+        {
+            if (subtreeSizes[i] > target)
+            {
+                spine.push_back(i++);
+                continue;
+            }
+
+            size_t begin = i;
+            while (i < count && subtreeSizes[i] <= target && i + subtreeSizes[i] - begin <= target)
+                i += subtreeSizes[i];
+            partition.push_back({begin,i});
+        }
+
+        partitionedCount = count;
+        partitionedThreads = threads;
+    }
+
+    inline void updateRange(const SpatialRange& range)
+    {
+        MatrixKernels::multiplyParented(&combined[0],&transforms[0],&parents[0],range.begin,range.end);
+    }
+
+    void updateAll()
+    {
+        if (!ordered || overflowCount()) rebuild();
+        clearDirty();
+        updatedNodes = size();
+
+        int threads = threadCount();
+        if (threads == 1 || size() < parallelThreshold)
+        {
+            if (size()) updateRange({0,size()});
+            return;
+        }
+
+        if (partitionedCount != size() || partitionedThreads != threads) buildPartition(threads);
+
+        for (size_t index : spine) updateRange({index,index + 1});
+
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < partition.size(); i++) updateRange(partition[i]);
+    }
+
+    void update()
+    {
+        // Reordering already touches every node, recompute everything
+        if (!ordered || overflowCount() > size() / 8) return updateAll();
+
+        // The appended tail is recomputed whole after the ordered ranges, its parents are in either
+        dirtyIndexs.clear();
+        for (size_t slot : dirty)
+            if (indexs[slot] < orderedEnd) dirtyIndexs.push_back(indexs[slot]);
+        clearDirty();
+        std::sort(dirtyIndexs.begin(),dirtyIndexs.end());
+
+        // A dirty node inside the subtree of a previous dirty node is already covered by its range
+        updatedNodes = 0;
+        dirtyRanges.clear();
+        size_t coveredEnd = 0;
+        for (size_t index : dirtyIndexs)
+        {
+            if (index < coveredEnd) continue;
+            coveredEnd = index + subtreeSizes[index];
+            dirtyRanges.push_back({index,coveredEnd});
+            updatedNodes += subtreeSizes[index];
+        }
+
+        if (updatedNodes * 2 > size()) return updateAll();
+
+        if (updatedNodes < parallelThreshold)
+        {
+            for (const SpatialRange& range : dirtyRanges) updateRange(range);
+        }
+        else
+        {
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t i = 0; i < dirtyRanges.size(); i++) updateRange(dirtyRanges[i]);
+        }
+
+        if (overflowCount()) updateRange({orderedEnd,size()});
+        updatedNodes += overflowCount();
     }
 };
 
+namespace SpatialLoader
+{
+    SpatialHierarchy hierarchy;
+}
+
+/*
+ * Owning handle over a node of SpatialLoader::hierarchy, the node and its subtree are freed with the handle. Handles
+ * move but don't copy, a moved from handle owns nothing
+ */
 struct Spatial
 {
-    SpatialNode* node;
+    SpatialID node;
 
-    Spatial(const glm::mat4& transform) : node(new SpatialNode(nullptr,transform)) { }
-    Spatial(const glm::mat4& transform,const Spatial& parent) : node(new SpatialNode(parent.node,transform)) { }
-    Spatial(const Spatial& other):  node(new SpatialNode(other.node->parent,other.node->transform)) { }
+    Spatial(const glm::mat4& transform) : node(SpatialLoader::hierarchy.create(transform)) { }
+    Spatial(const glm::mat4& transform,const Spatial& parent) : node(SpatialLoader::hierarchy.create(transform,parent.node)) { }
+    Spatial(const Spatial&) = delete;
+    Spatial(Spatial&& other) : node(other.node) { other.node = SpatialHierarchy::noParent; }
+    ~Spatial() { destroy(); }
 
-    operator glm::mat4() const { return node->transform; }
+    operator glm::mat4() const { return SpatialLoader::hierarchy.getTransform(node); }
 
-    inline SpatialNode* getNode() { return node; }
+    inline SpatialID getNode() const { return node; }
+    inline bool isValid() const { return SpatialLoader::hierarchy.isValid(node); }
+    inline const glm::mat4& getCombined() const { return SpatialLoader::hierarchy.getCombined(node); }
 
-    void setParent(const Spatial& parent) const 
-    { 
-        node->parent = parent.node;
-        parent.node->children.push_back(node);
+    void setParent(const Spatial& parent) const
+    {
+        SpatialLoader::hierarchy.setParent(node,parent.node);
     }
 
-    Spatial& operator=(const glm::mat4& transform) { node->transform = transform; node->cacheFrame = 0; return *this; }
-    Spatial& operator=(const Spatial& other) { node = other.node; return *this; }
+    // Frees the node and its children early, other handles to them become invalid
+    inline void destroy()
+    {
+        SpatialLoader::hierarchy.destroy(node);
+        node = SpatialHierarchy::noParent;
+    }
+
+    Spatial& operator=(const glm::mat4& transform) { SpatialLoader::hierarchy.setTransform(node,transform); return *this; }
+    Spatial& operator=(const Transform& transform) { SpatialLoader::hierarchy.setTransform(node,transform.getMatrix()); return *this; }
+    Spatial& operator=(const Spatial&) = delete;
+    Spatial& operator=(Spatial&& other)
+    {
+        if (this == &other) return *this;
+        destroy();
+        node = other.node;
+        other.node = SpatialHierarchy::noParent;
+        return *this;
+    }
 };
@@ -0,0 +1,65 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+/*
+ * Decomposed local transform, translation * rotation * scale. The matrix is only rebuilt after something changed and
+ * the rotation is kept as a normalized quaternion, so stacking small rotations every frame doesn't drift.
+ */
+struct Transform
+{
+    glm::vec3 translation;
+    glm::quat rotation;
+    glm::vec3 scale;
+
+    mutable glm::mat4 matrix;
+    mutable bool dirty = true;
+
+    Transform(const glm::vec3& _translation = glm::vec3(0.0f),const glm::quat& _rotation = glm::quat(1.0f,0.0f,0.0f,0.0f),const glm::vec3& _scale = glm::vec3(1.0f)) :
+    translation(_translation),
+    rotation(_rotation),
+    scale(_scale)
+    { }
+
+    inline void setTranslation(const glm::vec3& _translation) { translation = _translation; dirty = true; }
+    inline void setRotation(const glm::quat& _rotation) { rotation = glm::normalize(_rotation); dirty = true; }
+    inline void setScale(const glm::vec3& _scale) { scale = _scale; dirty = true; }
+
+    // Rotates in local space, same as glm::rotate(matrix,angle,axis) as long as the scale is uniform
+    inline void rotate(float angle,const glm::vec3& axis)
+    {
+        rotation = glm::normalize(rotation * glm::angleAxis(angle,glm::normalize(axis)));
+        dirty = true;
+    }
+
+    inline bool uniformScale() const { return scale.x == scale.y && scale.y == scale.z; }
+
+    const glm::mat4& getMatrix() const
+    {
+        if (dirty)
+        {
+            glm::mat3 r = glm::mat3_cast(rotation);
+            matrix = glm::mat4(
+                glm::vec4(r[0] * scale.x,0.0f),
+                glm::vec4(r[1] * scale.y,0.0f),
+                glm::vec4(r[2] * scale.z,0.0f),
+                glm::vec4(translation,1.0f));
+            dirty = false;
+        }
+        return matrix;
+    }
+
+    /*
+     * transpose(inverse(R * S)) is R * inverse(S), no 4x4 inverse needed
+     */
+    glm::mat3 normalMatrix() const
+    {
+        glm::mat3 r = glm::mat3_cast(rotation);
+        if (uniformScale()) return r * (1.0f / scale.x);
+
+        r[0] /= scale.x;
+        r[1] /= scale.y;
+        r[2] /= scale.z;
+        return r;
+    }
+};
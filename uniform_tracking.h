@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*
+ * Change tracking between material instances and the programs reading them. An instance bumps its version on every
+ * change and stamps the slots set through it with the version they were set at. A program remembers the instance and
+ * version it uploaded last, switching to another instance uploads all of its slots, the same instance changed since
+ * only the slots stamped after that version and the same unchanged instance nothing.
+ */
+struct InstanceChanges
+{
+    uint32_t version = 0;
+    std::vector<uint32_t> slotVersions;     // Version slot i was last set at, only as long as the last slot set
+
+    inline void markUniform(size_t slot)
+    {
+        version++;
+        if (slotVersions.size() <= slot) slotVersions.resize(slot + 1,0);
+        slotVersions[slot] = version;
+    }
+
+    inline void markTextures() { version++; }
+
+    // Bit i set if slot i was set after version since
+    inline uint64_t changedSince(uint32_t since) const
+    {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < slotVersions.size() && i < 64; i++) bits |= uint64_t(slotVersions[i] > since) << i;
+        return bits;
+    }
+};
+
+struct BoundInstance
+{
+    const static size_t none = ~size_t(0);
+
+    size_t instance = none;
+    uint32_t version = 0;
+    bool texturesBound = false;     // Cleared when the program is bound again, other programs may have used the units
+
+    /*
+     * Works out what switching to instance has to upload given all the uniform slots and texture units it has,
+     * returns false when nothing
+     */
+    inline bool update(size_t _instance,const InstanceChanges& changes,uint64_t allUniforms,uint32_t allTextures,
+                       uint64_t& uniforms,uint32_t& textures)
+    {
+        bool changed = instance == _instance && version != changes.version;
+        if (instance != _instance) uniforms = allUniforms;
+        else uniforms = changed ? changes.changedSince(version) & allUniforms : 0;
+        textures = instance != _instance || changed || !texturesBound ? allTextures : 0;
+
+        instance = _instance;
+        version = changes.version;
+        texturesBound = true;
+        return uniforms || textures;
+    }
+};
+
+// Low count bits set
+inline uint64_t lowBits(size_t count)
+{
+    return count >= 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+}
+
+// Calls f with the index of every set bit, lowest first
+template <typename F>
+inline void forEachBit(uint64_t bits,F f)
+{
+    for (; bits; bits &= bits - 1) f(size_t(__builtin_ctzll(bits)));
+}
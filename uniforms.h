@@ -0,0 +1,207 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <tuple>
+#include <array>
+#include <utility>
+#include <type_traits>
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Values of material instance uniforms. The types are listed once in UniformTypes and the UniformType of a type is
+ * its index there. Instances keep their values packed std140 in one block (UniformBlockLayout) and every type gets
+ * its own routines at compile time to pack, unpack and upload a packed value. Materials keep one upload routine per
+ * loose instance uniform picked from the reflected GL type, so uploads never branch on the type. Expects the GL
+ * declarations to be visible before the include.
+ */
+using UniformTypes = std::tuple<glm::vec2,glm::vec3,glm::vec4,glm::mat2,glm::mat3,glm::mat4,float,bool,int>;
+
+enum UniformType { VEC2 = 0, VEC3, VEC4, MAT2, MAT3, MAT4, FLOAT, BOOL, INT, UNIFORM_TYPE_COUNT };
+static_assert(UNIFORM_TYPE_COUNT == std::tuple_size<UniformTypes>::value,"UniformType doesn't match UniformTypes");
+
+template <typename T,size_t I = 0>
+constexpr bool isUniformType()
+{
+    if constexpr (I == std::tuple_size<UniformTypes>::value) return false;
+    else return std::is_same<T,std::tuple_element_t<I,UniformTypes>>::value || isUniformType<T,I + 1>();
+}
+
+template <typename T,size_t I = 0>
+constexpr UniformType uniformTypeOf()
+{
+    static_assert(isUniformType<T>(),"Not a uniform type");
+    if constexpr (std::is_same<T,std::tuple_element_t<I,UniformTypes>>::value) return UniformType(I);
+    else return uniformTypeOf<T,I + 1>();
+}
+
+using UniformID = size_t;
+class Uniform
+{
+    public:
+    UniformType type;
+
+    Uniform() { }
+
+    template <typename T,typename = std::enable_if_t<isUniformType<T>()>>
+    Uniform(const T& value) { set(value); }
+
+    template <typename T>
+    inline void set(const T& value)
+    {
+        type = uniformTypeOf<T>();
+        std::memcpy(storage,&value,sizeof(T));
+    }
+
+    template <typename T>
+    inline const T& get() const { return *reinterpret_cast<const T*>(storage); }
+
+    private:
+    alignas(glm::mat4) unsigned char storage[sizeof(glm::mat4)];
+};
+
+/*
+ * std140 base alignment and size. Scalars take 4 bytes, bool too, vec3 is aligned as a vec4 and matrices are arrays of
+ * vec4 aligned columns
+ */
+template <typename T> struct Std140 { const static uint32_t align = 4, size = 4; };
+template <> struct Std140<glm::vec2> { const static uint32_t align = 8, size = 8; };
+template <> struct Std140<glm::vec3> { const static uint32_t align = 16, size = 12; };
+template <> struct Std140<glm::vec4> { const static uint32_t align = 16, size = 16; };
+template <> struct Std140<glm::mat2> { const static uint32_t align = 16, size = 32, columns = 2; };
+template <> struct Std140<glm::mat3> { const static uint32_t align = 16, size = 48, columns = 3; };
+template <> struct Std140<glm::mat4> { const static uint32_t align = 16, size = 64; };
+
+template <typename T>
+constexpr bool isPaddedMatrix() { return std::is_same<T,glm::mat2>::value || std::is_same<T,glm::mat3>::value; }
+
+template <typename T>
+inline void std140Write(void* destination,const T& value)
+{
+    if constexpr (std::is_same<T,bool>::value)
+    {
+        int32_t asInt = value;
+        std::memcpy(destination,&asInt,sizeof(asInt));
+    }
+    else if constexpr (isPaddedMatrix<T>())
+    {
+        for (uint32_t c = 0; c < Std140<T>::columns; c++) std::memcpy((unsigned char*)destination + 16 * c,&value[c],sizeof(value[c]));
+    }
+    else std::memcpy(destination,&value,sizeof(T));
+}
+
+template <typename T>
+inline T std140Read(const void* source)
+{
+    T value;
+    if constexpr (std::is_same<T,bool>::value)
+    {
+        int32_t asInt;
+        std::memcpy(&asInt,source,sizeof(asInt));
+        value = asInt != 0;
+    }
+    else if constexpr (isPaddedMatrix<T>())
+    {
+        for (uint32_t c = 0; c < Std140<T>::columns; c++) std::memcpy(&value[c],(const unsigned char*)source + 16 * c,sizeof(value[c]));
+    }
+    else std::memcpy(&value,source,sizeof(T));
+    return value;
+}
+
+inline void uploadUniform(GLint location,const glm::vec2& value) { glUniform2fv(location,1,&value[0]); }
+inline void uploadUniform(GLint location,const glm::vec3& value) { glUniform3fv(location,1,&value[0]); }
+inline void uploadUniform(GLint location,const glm::vec4& value) { glUniform4fv(location,1,&value[0]); }
+inline void uploadUniform(GLint location,const glm::mat2& value) { glUniformMatrix2fv(location,1,GL_FALSE,&value[0][0]); }
+inline void uploadUniform(GLint location,const glm::mat3& value) { glUniformMatrix3fv(location,1,GL_FALSE,&value[0][0]); }
+inline void uploadUniform(GLint location,const glm::mat4& value) { glUniformMatrix4fv(location,1,GL_FALSE,&value[0][0]); }
+inline void uploadUniform(GLint location,float value) { glUniform1f(location,value); }
+inline void uploadUniform(GLint location,bool value) { glUniform1i(location,value); }
+inline void uploadUniform(GLint location,int value) { glUniform1i(location,value); }
+
+// Routines over a value packed std140
+using UniformUploader = void (*)(GLint location,const void* packed);
+using UniformPacker = void (*)(void* packed,const Uniform& value);
+using UniformUnpacker = Uniform (*)(const void* packed);
+
+template <typename T>
+void uploadAs(GLint location,const void* packed) { uploadUniform(location,std140Read<T>(packed)); }
+
+template <typename T>
+void packAs(void* packed,const Uniform& value) { std140Write(packed,value.get<T>()); }
+
+template <typename T>
+Uniform unpackAs(const void* packed) { return Uniform(std140Read<T>(packed)); }
+
+template <typename T>
+Uniform zeroAs() { return Uniform(T(0.0f)); }
+
+template <typename T>
+struct UniformRoutines
+{
+    constexpr static UniformUploader upload = &uploadAs<T>;
+    constexpr static UniformPacker pack = &packAs<T>;
+    constexpr static UniformUnpacker unpack = &unpackAs<T>;
+    constexpr static Uniform (*zero)() = &zeroAs<T>;
+    constexpr static uint32_t align = Std140<T>::align,size = Std140<T>::size;
+};
+
+// One entry per UniformType, a member of UniformRoutines for each type
+template <typename R,typename F,size_t... I>
+constexpr std::array<R,sizeof...(I)> makeUniformTable(F field,std::index_sequence<I...>)
+{
+    return {field(UniformRoutines<std::tuple_element_t<I,UniformTypes>>())...};
+}
+
+template <typename R,typename F>
+constexpr std::array<R,UNIFORM_TYPE_COUNT> uniformTable(F field)
+{
+    return makeUniformTable<R>(field,std::make_index_sequence<UNIFORM_TYPE_COUNT>());
+}
+
+inline constexpr auto uniformUploaders = uniformTable<UniformUploader>([](auto r) { return r.upload; });
+inline constexpr auto uniformPackers = uniformTable<UniformPacker>([](auto r) { return r.pack; });
+inline constexpr auto uniformUnpackers = uniformTable<UniformUnpacker>([](auto r) { return r.unpack; });
+inline constexpr auto uniformZeros = uniformTable<Uniform (*)()>([](auto r) { return r.zero; });
+inline constexpr auto uniformAligns = uniformTable<uint32_t>([](auto r) { return r.align; });
+inline constexpr auto uniformSizes = uniformTable<uint32_t>([](auto r) { return r.size; });
+
+/*
+ * std140 offsets of a list of uniforms, as a GLSL uniform block declaring them in the same order lays them out
+ */
+struct UniformBlockLayout
+{
+    std::vector<UniformType> types;
+    std::vector<uint32_t> offsets;
+    uint32_t size = 0;              // Rounded up to 16, the base alignment of the block
+
+    UniformBlockLayout(const std::vector<UniformType>& _types) : types(_types)
+    {
+        for (UniformType type : types)
+        {
+            uint32_t align = uniformAligns[type];
+            size = (size + align - 1) / align * align;
+            offsets.push_back(size);
+            size += uniformSizes[type];
+        }
+        size = (size + 15) / 16 * 16;
+    }
+};
+
+// UniformType of a reflected GL uniform type, UNIFORM_TYPE_COUNT for the ones instances can't hold
+inline UniformType uniformTypeOfGL(GLenum type)
+{
+    switch (type)
+    {
+        case GL_FLOAT_VEC2: return VEC2;
+        case GL_FLOAT_VEC3: return VEC3;
+        case GL_FLOAT_VEC4: return VEC4;
+        case GL_FLOAT_MAT2: return MAT2;
+        case GL_FLOAT_MAT3: return MAT3;
+        case GL_FLOAT_MAT4: return MAT4;
+        case GL_FLOAT: return FLOAT;
+        case GL_BOOL: return BOOL;
+        case GL_INT: return INT;
+    }
+    return UNIFORM_TYPE_COUNT;
+}
@@ -5,7 +5,7 @@
 
 using Window = GLFWwindow;
 
-inline Window* createWindow()
+inline Window* createWindow(bool visible = true)
 {
     // Initialise GLFW
     glewExperimental = true; // Needed for core profile
@@ -16,14 +16,19 @@ inline Window* createWindow()
     }
 
     glfwWindowHint(GLFW_SAMPLES, 4); // 4x antialiasing
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3); // We want OpenGL 3.3
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE); // We don't want the old OpenGL 
+    glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE); // Hidden windows for headless benchmarks
     
-    // Open a window and create its OpenGL context
-    GLFWwindow* window; // (In the accompanying source code, this variable is global for simplicity)
-    window = glfwCreateWindow( 1024, 768, "Tutorial 01", NULL, NULL);
+    // Open a window and create its OpenGL context, 4.4 adds persistent buffers, 4.3 multi draw indirect, 3.3 is the minimum
+    GLFWwindow* window = NULL; // (In the accompanying source code, this variable is global for simplicity)
+    const int versions[][2] = {{4,4},{4,3},{3,3}};
+    for (int i = 0; i < 3 && window == NULL; i++)
+    {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, versions[i][0]);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, versions[i][1]);
+        window = glfwCreateWindow( 1024, 768, "Tutorial 01", NULL, NULL);
+    }
     if( window == NULL ){
         fprintf( stderr, "Failed to open GLFW window. If you have an Intel GPU, they are not 3.3 compatible. Try the 2.1 version of the tutorials.\n" );
         glfwTerminate();